@@ -20,8 +20,95 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 */
 
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 #include "raz/bitset.hpp"
 
+// the first position of 'count' false bits starting at 'pos' (or bits.size())
+size_t findFalseRange(const std::vector<bool>& bits, size_t count, size_t pos)
+{
+	for (size_t first = pos; first + count <= bits.size(); ++first)
+	{
+		size_t run = 0;
+		while (run < count && !bits[first + run])
+			++run;
+
+		if (run == count)
+			return first;
+	}
+
+	return bits.size();
+}
+
+// compares the range operations with a plain vector<bool>, the ranges start, end or cross word boundaries,
+// or cover full words
+template<class BitsetType>
+size_t checkRanges(BitsetType& bitset, size_t bits)
+{
+	const size_t ranges[][2] = { { 0, 0 }, { 0, 1 }, { 0, 32 }, { 32, 32 }, { 31, 2 }, { 30, 40 }, { 1, 63 }, { 33, 31 }, { bits - 1, 1 }, { bits, 0 }, { 0, bits } };
+	const size_t counts[] = { 1, 2, 31, 32, 33, 63, 64, 65, bits };
+	const size_t positions[] = { 0, 1, 31, 32, 33, 63, 64 };
+	size_t failed = 0;
+
+	for (bool initial : { false, true })
+	{
+		for (auto& range : ranges)
+		{
+			std::vector<bool> expected(bits, initial);
+			bitset.unsetRange(0, bits);
+			if (initial)
+				bitset.setRange(0, bits);
+
+			// the range is flipped, so it's a run of true bits between false ones or the other way around
+			for (size_t pos = range[0]; pos < range[0] + range[1]; ++pos)
+				expected[pos] = !initial;
+
+			if (initial)
+				bitset.unsetRange(range[0], range[1]);
+			else
+				bitset.setRange(range[0], range[1]);
+
+			for (size_t pos = 0; pos < bits; ++pos)
+			{
+				if (bitset.isset(pos) != expected[pos])
+				{
+					std::cout << "bit " << pos << " is wrong after changing [" << range[0] << ", +" << range[1] << ")" << std::endl;
+					++failed;
+					break;
+				}
+			}
+
+			for (size_t count : counts)
+			{
+				for (size_t pos : positions)
+				{
+					if (bitset.findFalseRange(count, pos) != findFalseRange(expected, count, pos))
+					{
+						std::cout << "findFalseRange(" << count << ", " << pos << ") is wrong after changing [" << range[0] << ", +" << range[1] << ")" << std::endl;
+						++failed;
+					}
+				}
+			}
+		}
+	}
+
+	// ranges that don't fit are rejected
+	for (size_t pos : { bits - 1, bits + 1 })
+	{
+		try
+		{
+			bitset.setRange(pos, 2);
+			std::cout << "setRange(" << pos << ", 2) didn't throw" << std::endl;
+			++failed;
+		}
+		catch (std::out_of_range&)
+		{
+		}
+	}
+
+	return failed;
+}
+
 int main()
 {
 	raz::Bitset<32> bitset; // by default all 32 bits are set to false
@@ -46,5 +133,10 @@ int main()
 	}
 	std::cout << std::endl;
 
+	raz::Bitset<96> fixed_bitset; // whole words only
+	raz::DynamicBitset dynamic_bitset(100); // the last word is partial
+	const size_t failed = checkRanges(fixed_bitset, 96) + checkRanges(dynamic_bitset, 100);
+	std::cout << "range checks: " << (failed ? "failed" : "passed") << std::endl;
+
 	return 0;
 }
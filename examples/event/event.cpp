@@ -19,7 +19,10 @@ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 */
 
+#include <atomic>
 #include <iostream>
+#include <thread>
+#include <vector>
 #include "raz/event.hpp"
 
 struct XEvent
@@ -55,6 +58,69 @@ struct XYZEventReceiver : /* public */ raz::EventReceiver<XYZEventReceiver>
 	}
 };
 
+struct CountingReceiver : raz::EventReceiver<CountingReceiver>
+{
+	CountingReceiver(std::atomic<size_t>& received) : received(received)
+	{
+	}
+
+	void operator()(const XEvent&)
+	{
+		++received;
+	}
+
+	std::atomic<size_t>& received;
+};
+
+// the handler tables replaced by bind/unbind are freed while other threads keep dispatching,
+// so the memory used by the dispatcher stays bounded
+void concurrentDispatch()
+{
+	using namespace raz::literal;
+	static raz::MemoryPool<1_MB> pool;
+	raz::InstrumentedPool<> memory(&pool);
+	std::atomic<size_t> received(0);
+	std::atomic<bool> done(false);
+
+	{
+		raz::EventDispatcher dispatcher(nullptr, &memory);
+		std::vector<std::thread> dispatchers;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			dispatchers.emplace_back([&]
+			{
+				while (!done)
+					dispatcher(XEvent{ 1 });
+			});
+		}
+
+		for (int i = 0; i < 20000; ++i)
+		{
+			auto receiver = std::make_shared<CountingReceiver>(received);
+			receiver->bind<XEvent>(dispatcher);
+
+			// every other receiver expires instead, and the next dispatch removes its handler
+			if (i % 2)
+			{
+				receiver->unbind<XEvent>(dispatcher);
+			}
+			else
+			{
+				receiver.reset();
+				dispatcher(XEvent{ 0 });
+			}
+		}
+
+		done = true;
+		for (auto& thread : dispatchers)
+			thread.join();
+	}
+
+	std::cout << received << " events received while binding and unbinding, peak memory usage: "
+		<< memory.getStats().peak_used_memory << " bytes" << std::endl;
+}
+
 int main()
 {
 	raz::TaskManager taskmgr;
@@ -66,5 +132,7 @@ int main()
 	dispatcher(XEvent{ 123 });
 	std::this_thread::sleep_for(std::chrono::milliseconds(200));
 
+	concurrentDispatch();
+
 	return 0;
 }
@@ -19,14 +19,19 @@ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 */
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <thread>
 #include <vector>
+#include "raz/input.hpp"
 #include "raz/memory.hpp"
 #include "raz/random.hpp"
 
 using namespace raz::literal;
 
-int main()
+void example01()
 {
 	raz::MemoryPool<1_KB> mem;
 	std::vector<int, raz::Allocator<int>> vector(&mem);
@@ -39,6 +44,296 @@ int main()
 	for (int n : vector)
 		std::cout << n << ", ";
 	std::cout << std::endl;
+}
+
+template<class Pool>
+double benchmark(Pool& pool, size_t capacity, size_t block_size, int fill_percent)
+{
+	std::vector<void*> blocks;
+
+	// fill the pool (except for a small tail), then free blocks evenly until the fill level is reached,
+	// so the measured (twice as large) allocations only fit into the larger holes
+	const size_t total_blocks = capacity / block_size - 2;
+	const size_t free_blocks = total_blocks - (capacity / block_size * fill_percent / 100);
+
+	for (size_t i = 0; i < total_blocks; ++i)
+		blocks.push_back(pool.allocate(block_size));
+
+	for (size_t i = 0; i < total_blocks; ++i)
+	{
+		if ((i + 1) * free_blocks / total_blocks != i * free_blocks / total_blocks)
+		{
+			pool.deallocate(blocks[i], block_size);
+			blocks[i] = nullptr;
+		}
+	}
+
+	const int iterations = 10000;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		void* ptr = pool.allocate(block_size * 2);
+		pool.deallocate(ptr, block_size * 2);
+	}
+
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	for (void* ptr : blocks)
+	{
+		if (ptr)
+			pool.deallocate(ptr, block_size);
+	}
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+void example02()
+{
+	typedef raz::MemoryPool<1_MB, 64> Pool;
+	typedef raz::SlabPool<> Slab;
+
+	// Pool is over-aligned, which plain new only respects since C++17, so it's allocated from memory mapped from the OS
+	raz::DynamicMemoryPool<> memory(4_MB);
+
+	for (int fill : { 10, 50, 90 })
+	{
+		raz::PoolPtr<Pool> pool = raz::make_pooled<Pool>(&memory);
+		std::unique_ptr<Slab> slab(new Slab());
+
+		std::cout << fill << "% fill: "
+			<< "MemoryPool " << benchmark(*pool, 1_MB, 64, fill) << " ns, "
+			<< "SlabPool " << benchmark(*slab, 1_MB, 64, fill) << " ns" << std::endl;
+	}
+}
+
+void example03()
+{
+	raz::ArenaPool<> arena;
+
+	for (int frame = 0; frame < 3; ++frame)
+	{
+		{
+			std::vector<int, raz::Allocator<int>> vector(&arena);
+
+			for (int i = 0; i < 1000; ++i)
+				vector.push_back(i * frame);
+
+			std::cout << "frame " << frame << ": " << arena.getUsedMemory() << " bytes used" << std::endl;
+		}
+
+		arena.reset(); // everything allocated during this frame is gone at once
+	}
+}
+
+void example04()
+{
+	// capacity (and growth) can come from configuration, the memory is mapped from the OS
+	size_t capacity = 64_MB;
+	raz::DynamicMemoryPool<> mem(capacity, 16_MB, raz::TRANSPARENT_HUGE_PAGES);
+	std::vector<char, raz::Allocator<char>> buffer(&mem);
+
+	buffer.resize(100_MB); // doesn't fit into the initial region, so a new one is added
+
+	std::cout << "capacity: " << mem.getCapacity() << ", used: " << mem.getUsedMemory() << std::endl;
+}
+
+void example05()
+{
+	raz::MemoryPool<64_KB, 64, void> mem; // InstrumentedPool does the locking
+	raz::InstrumentedPool<> instrumented(&mem);
+	std::vector<int, raz::Allocator<int>> vector(&instrumented);
+
+	for (int i = 0; i < 1000; ++i)
+		vector.push_back(i);
+
+	auto stats = instrumented.getStats();
+
+	uint64_t allocations = 0;
+	for (auto count : stats.allocations)
+		allocations += count;
+
+	std::cout << allocations << " allocations, peak usage: " << stats.peak_used_memory
+		<< " bytes, fragmentation: " << stats.fragmentation << std::endl;
+}
+
+void example06()
+{
+	struct Buffer
+	{
+		Buffer(size_t id) : id(id)
+		{
+		}
+
+		size_t id;
+		char data[2048];
+	};
+
+	static raz::ObjectPool<Buffer, 16> pool; // preallocates 16 buffers
+
+	{
+		auto buffer1 = pool.acquire(1);
+		auto buffer2 = pool.acquire(2);
+		std::cout << "buffers in use: " << pool.getUsedMemory() / sizeof(Buffer) << std::endl;
+	}
+
+	std::cout << "buffers in use: " << pool.getUsedMemory() / sizeof(Buffer) << std::endl;
+}
+
+void example07()
+{
+	static raz::RelocatablePool<1_MB, 64, void> pool;
+	std::vector<raz::Handle<char>> packets;
+	raz::Random random(12345);
+
+	// fill the pool with variable size packet buffers, then drop every second one
+	try
+	{
+		for (;;)
+			packets.push_back(pool.allocate(random(64, 4096)));
+	}
+	catch (std::bad_alloc&)
+	{
+	}
+
+	for (size_t i = 0; i < packets.size(); i += 2)
+		packets[i].reset();
+
+	auto print_histogram = [](const raz::FreeRunHistogram& histogram)
+	{
+		std::cout << "free memory: " << histogram.free_memory << ", largest run: " << histogram.largest_run
+			<< ", runs for 16KB: " << histogram.countRunsFor(16_KB) << std::endl;
+	};
+
+	print_histogram(pool.getFreeRunHistogram());
+	std::cout << "compacting moved " << pool.compact() << " bytes" << std::endl;
+	print_histogram(pool.getFreeRunHistogram());
+
+	auto large_packet = pool.allocate(16_KB);
+	std::cout << "large packet size: " << large_packet.size() << std::endl;
+}
+
+void example08()
+{
+	const int thread_count = 4;
+	const int block_count = 10000;
+
+	std::unique_ptr<raz::ThreadCachedPool<>> pool(new raz::ThreadCachedPool<>());
+	std::vector<std::vector<void*>> blocks(thread_count);
+	std::atomic<int> allocated(0);
+	std::atomic<int> freed(0);
+	std::atomic<bool> exit(false);
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < thread_count; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			raz::Random random(t + 1);
+
+			for (int i = 0; i < block_count; ++i)
+				blocks[t].push_back(pool->allocate(random(1, 512)));
+
+			++allocated;
+			while (allocated < thread_count)
+				std::this_thread::yield();
+
+			// the blocks of the next thread are freed here, so they end up in this thread's cache
+			raz::Random next_random((t + 1) % thread_count + 1);
+			for (void* ptr : blocks[(t + 1) % thread_count])
+				pool->deallocate(ptr, next_random(1, 512));
+
+			++freed;
+
+			// the pool is destroyed while this thread still has blocks in its cache
+			while (!exit)
+				std::this_thread::yield();
+		});
+	}
+
+	while (freed < thread_count)
+		std::this_thread::yield();
+
+	std::cout << "used memory: " << pool->getUsedMemory() << ", cached: " << pool->getFreeMemory() << " bytes" << std::endl;
+	pool.reset();
+
+	exit = true;
+	for (auto& thread : threads)
+		thread.join();
+}
+
+void example09()
+{
+	// the pool works (with the default memory policy) even if the memory can't be bound to the node
+	raz::NumaMemoryPool<> pool(0, 16_MB);
+	std::cout << "NUMA node " << pool.getNumaNode() << (pool.isBound() ? " bound" : " not bound") << std::endl;
+
+	// e.g. page aligned buffers for direct I/O, and cache line aligned counters that don't share a line
+	for (size_t alignment : { size_t(64), size_t(4_KB) })
+	{
+		void* ptr = pool.allocateAligned(1000, alignment);
+		const bool aligned = (reinterpret_cast<uintptr_t>(ptr) % alignment == 0);
+		std::cout << alignment << " byte alignment: " << (aligned ? "ok" : "failed") << std::endl;
+		pool.deallocateAligned(ptr, 1000, alignment);
+	}
+
+	std::cout << "used memory after freeing: " << pool.getUsedMemory() << std::endl;
+}
+
+void example10()
+{
+	struct Packet
+	{
+		Packet(int id) : id(id)
+		{
+		}
+
+		int id;
+		char data[200];
+	};
+
+	// an action type of our own, allocated from the same pool as the built-in ones
+	struct AnyKeyAction : public raz::Action
+	{
+		AnyKeyAction(raz::IMemoryPool* memory) : raz::Action(memory)
+		{
+		}
+
+		virtual bool tryInput(const raz::Input& input) const
+		{
+			return (input.type == raz::Input::ButtonPressed);
+		}
+	};
+
+	raz::MemoryPool<64_KB, 64, void> mem; // InstrumentedPool does the locking
+	raz::InstrumentedPool<> memory(&mem);
+
+	{
+		raz::PoolPtr<Packet> packet = raz::make_pooled<Packet>(&memory, 1);
+		std::shared_ptr<Packet> shared_packet = raz::allocate_shared<Packet>(&memory, 2); // one allocation for the object and the control block
+
+		raz::PoolPtr<raz::Action> any_key = raz::make_pooled<AnyKeyAction>(&memory, &memory); // returned to the pool as an AnyKeyAction
+		raz::ActionPtr custom = raz::Action::custom([](const raz::Input&) { return false; }, &memory);
+
+		std::cout << "packets " << packet->id << " and " << shared_packet->id << ", actions from the pool: "
+			<< (any_key->getMemoryPool() == &memory && custom->getMemoryPool() == &memory) << ", used memory: " << memory.getUsedMemory() << std::endl;
+	}
+
+	std::cout << "used memory after releasing them: " << memory.getUsedMemory() << std::endl;
+}
+
+int main()
+{
+	example01();
+	example02();
+	example03();
+	example04();
+	example05();
+	example06();
+	example07();
+	example08();
+	example09();
+	example10();
 
 	return 0;
 }
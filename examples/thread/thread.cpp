@@ -19,10 +19,24 @@ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include "raz/coroutine.hpp"
+#include "raz/parallel.hpp"
+#include "raz/random.hpp"
+#include "raz/scheduler.hpp"
 #include "raz/thread.hpp"
 
+using namespace raz::literal;
+
 class Loopable
 {
 public:
@@ -62,6 +76,61 @@ public:
 	}
 };
 
+class Bouncer
+{
+	raz::Thread<Bouncer>* other;
+	std::promise<void>* done;
+
+public:
+	Bouncer(raz::Thread<Bouncer>* other, std::promise<void>* done) : other(other), done(done)
+	{
+	}
+
+	void operator()(int remaining_hops)
+	{
+		if (remaining_hops == 0)
+			done->set_value();
+		else
+			(*other)(remaining_hops - 1);
+	}
+};
+
+class AccountShard
+{
+	std::map<std::string, int> balances;
+
+public:
+	void operator()(std::string account, int amount)
+	{
+		// no locking, every account belongs to exactly one shard
+		balances[account] += amount;
+	}
+
+	void operator()(std::promise<int>& total)
+	{
+		int sum = 0;
+		for (auto& balance : balances)
+			sum += balance.second;
+
+		total.set_value(sum);
+	}
+};
+
+class MessageCounter
+{
+	std::atomic<size_t>* counter;
+
+public:
+	MessageCounter(std::atomic<size_t>* counter) : counter(counter)
+	{
+	}
+
+	void operator()(size_t value)
+	{
+		counter->fetch_add(value, std::memory_order_relaxed);
+	}
+};
+
 void example01()
 {
 	raz::Thread<Loopable> thread;
@@ -106,12 +175,543 @@ void example04()
 	std::this_thread::sleep_for(std::chrono::milliseconds(200));
 }
 
+void example05()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	const size_t task_count = 100000;
+	std::vector<Clock::duration> latencies(task_count);
+	std::atomic<size_t> finished_tasks(0);
+	raz::TaskManager taskmgr;
+
+	auto tiny_task = [&](size_t i, Clock::time_point enqueued)
+	{
+		latencies[i] = Clock::now() - enqueued;
+		finished_tasks.fetch_add(1);
+	};
+
+	auto report = [&](const char* name, Clock::duration elapsed)
+	{
+		std::sort(latencies.begin(), latencies.end());
+		auto percentile = [&](double p)
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(latencies[static_cast<size_t>(p * (task_count - 1))]).count();
+		};
+
+		std::cout << name << ": " << task_count * 1000 / std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count())
+			<< " tasks/s, latency p50: " << percentile(0.5) << "us, p99: " << percentile(0.99) << "us, p99.9: " << percentile(0.999) << "us" << std::endl;
+	};
+
+	// every task is submitted from the main thread to the shared queue
+	auto start = Clock::now();
+	for (size_t i = 0; i < task_count; ++i)
+		taskmgr(tiny_task, i, Clock::now());
+
+	while (finished_tasks.load() < task_count)
+		std::this_thread::yield();
+
+	report("external submit", Clock::now() - start);
+
+	// tasks are spawned by other tasks, so they go to the workers' own queues and get stolen by idle workers
+	finished_tasks = 0;
+	start = Clock::now();
+	const size_t spawners = 100;
+	for (size_t s = 0; s < spawners; ++s)
+	{
+		taskmgr([&, s]
+		{
+			for (size_t i = s; i < task_count; i += spawners)
+				taskmgr(tiny_task, i, Clock::now());
+		});
+	}
+
+	while (finished_tasks.load() < task_count)
+		std::this_thread::yield();
+
+	report("spawned from workers", Clock::now() - start);
+}
+
+void example06()
+{
+	const int hops = 10000;
+
+	auto ping_pong = [hops](const char* name, raz::WakeupMode wakeup)
+	{
+		raz::Thread<Bouncer> ping(nullptr, wakeup);
+		raz::Thread<Bouncer> pong(nullptr, wakeup);
+		std::promise<void> done;
+
+		ping.start(&pong, &done);
+		pong.start(&ping, &done);
+
+		auto start = std::chrono::steady_clock::now();
+		ping(hops);
+		done.get_future().wait();
+		auto elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << name << ": " << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / hops
+			<< "ns per hop" << std::endl;
+	};
+
+	ping_pong("park", raz::WakeupMode::PARK);
+	ping_pong("spin then park", raz::WakeupMode::SPIN_THEN_PARK);
+}
+
+void example07()
+{
+	const size_t producers = 4;
+	const size_t messages = 1000000;
+
+	std::atomic<size_t> counter(0);
+	raz::Thread<MessageCounter> thread;
+	thread.start(&counter);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> producer_threads;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		producer_threads.emplace_back([&thread, messages]
+		{
+			for (size_t i = 0; i < messages; ++i)
+				thread(size_t(1));
+		});
+	}
+
+	for (auto& producer : producer_threads)
+		producer.join();
+
+	while (counter.load() < producers * messages)
+		std::this_thread::yield();
+
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "messages per second: "
+		<< producers * messages * 1000 / std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()) << std::endl;
+}
+
+void example08()
+{
+	raz::TaskManager taskmgr;
+
+	// continuations run on a worker once the previous stage is ready, no worker is blocked in between
+	auto parsed = taskmgr([] { return std::string("42"); })
+		.then([](const std::string& text) { return std::stoi(text); })
+		.then([](int value) { return value * 2; });
+
+	auto other = taskmgr([] { return 100; });
+
+	raz::when_all(parsed, other).wait();
+	std::cout << "pipeline result: " << parsed.get() + other.get() << std::endl;
+
+	// load -> (decode, decompress) -> upload
+	raz::TaskGraph graph(taskmgr);
+	auto load = graph.add([] { std::cout << "load" << std::endl; });
+	auto decode = graph.add([] { std::cout << "decode" << std::endl; });
+	auto decompress = graph.add([] { std::cout << "decompress" << std::endl; });
+	auto upload = graph.add([] { std::cout << "upload" << std::endl; });
+
+	graph.addDependency(decode, load);
+	graph.addDependency(decompress, load);
+	graph.addDependency(upload, decode);
+	graph.addDependency(upload, decompress);
+
+	graph.run().wait();
+}
+
+void example09()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<int> data(4000000);
+	raz::Random random(12345);
+	for (auto& value : data)
+		value = random(0, 1000000);
+
+	size_t max_threads = std::thread::hardware_concurrency();
+	if (max_threads == 0)
+		max_threads = 1;
+
+	// parallel_sort and parallel_reduce from 1 to N worker threads
+	for (size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		raz::TaskManager taskmgr(threads);
+		std::vector<int> sorted = data;
+
+		auto start = Clock::now();
+		raz::parallel_sort(taskmgr, sorted.begin(), sorted.end());
+		auto sort_time = Clock::now() - start;
+
+		start = Clock::now();
+		long long sum = raz::parallel_reduce(taskmgr, data.begin(), data.end(), 0LL);
+		auto reduce_time = Clock::now() - start;
+
+		std::cout << threads << " threads - sort: " << std::chrono::duration_cast<std::chrono::milliseconds>(sort_time).count()
+			<< "ms, reduce: " << std::chrono::duration_cast<std::chrono::microseconds>(reduce_time).count()
+			<< "us (sum: " << sum << ")" << std::endl;
+
+		if (threads < max_threads && threads * 2 > max_threads)
+			threads = max_threads / 2;
+	}
+}
+
+void example10()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static raz::MemoryPool<16_MB> pool;
+	raz::InstrumentedPool<> memory(&pool);
+	raz::TaskManager taskmgr(0, &memory);
+
+	auto countAllocations = [&memory]
+	{
+		auto stats = memory.getStats();
+		uint64_t allocations = 0;
+		for (auto count : stats.allocations)
+			allocations += count;
+		return allocations;
+	};
+
+	// every task should cost a single allocation from the pool: the task and the state of its future
+	const size_t tasks = 20000;
+	std::vector<raz::Future<int>> futures;
+	futures.reserve(tasks);
+
+	uint64_t allocations = countAllocations();
+	auto start = Clock::now();
+
+	for (size_t i = 0; i < tasks; ++i)
+		futures.push_back(taskmgr([](int value) { return value + 1; }, static_cast<int>(i)));
+
+	long long sum = 0;
+	for (auto& future : futures)
+		sum += future.get();
+
+	auto elapsed = Clock::now() - start;
+	allocations = countAllocations() - allocations;
+
+	std::cout << "allocations per task: " << static_cast<double>(allocations) / tasks
+		<< ", " << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / tasks
+		<< " ns/task (sum: " << sum << ")" << std::endl;
+}
+
+void example11()
+{
+	typedef raz::TaskManager::Clock Clock;
+
+	raz::TaskManager taskmgr;
+	std::vector<raz::Future<void>> bulk;
+
+	// a backlog of bulk jobs shouldn't delay the latency-sensitive tasks
+	for (int i = 0; i < 20000; ++i)
+	{
+		bulk.push_back(taskmgr(raz::BACKGROUND, []
+		{
+			volatile int sink = 0;
+			for (int j = 0; j < 1000; ++j)
+				sink = sink + j;
+		}));
+	}
+
+	std::cout << "queued background tasks: " << taskmgr.getQueueDepth(raz::BACKGROUND) << std::endl;
+
+	// polling instead of wait(), which would run a queued task on this thread
+	auto measure = [](raz::Future<Clock::time_point> future, Clock::time_point start)
+	{
+		while (!future.isReady())
+			std::this_thread::yield();
+
+		return std::chrono::duration_cast<std::chrono::microseconds>(future.get() - start).count();
+	};
+
+	auto start = Clock::now();
+	auto latency = measure(taskmgr(raz::HIGH, [] { return Clock::now(); }), start);
+	std::cout << "high priority task started after " << latency << "us" << std::endl;
+
+	start = Clock::now();
+	latency = measure(taskmgr(raz::NORMAL, start + std::chrono::milliseconds(1), [] { return Clock::now(); }), start);
+	std::cout << "deadline task started after " << latency << "us" << std::endl;
+
+	start = Clock::now();
+	latency = measure(taskmgr([] { return Clock::now(); }), start);
+	std::cout << "normal task started after " << latency << "us" << std::endl;
+
+	for (auto& future : bulk)
+		future.wait();
+}
+
+void example12()
+{
+	for (const auto& info : raz::getCpuTopology())
+		std::cout << "cpu" << info.cpu << ": core " << info.core << ", package " << info.package << ", node " << info.node << std::endl;
+
+	// one pinned worker per physical core, named "net-0", "net-1", ...
+	raz::TaskManagerConfig config;
+	config.name = "net";
+	config.stack_size = 256 * 1024;
+	config.topology_layout = true;
+
+	raz::TaskManager taskmgr(config);
+	std::cout << "workers: " << taskmgr.getWorkerCount() << std::endl;
+
+	raz::ThreadConfig thread_config;
+	thread_config.name = "bouncer";
+	thread_config.cpus = { 0 };
+
+	raz::Thread<Worker> thread(thread_config);
+	thread.start(10);
+	thread(5);
+	thread.stop();
+}
+
+void example13()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	raz::TaskManager taskmgr;
+	std::atomic<int> counter(0);
+	const size_t tasks = 10000;
+
+	// one by one
+	auto start = Clock::now();
+	std::vector<raz::Future<void>> futures;
+	futures.reserve(tasks);
+	for (size_t i = 0; i < tasks; ++i)
+		futures.push_back(taskmgr([&counter] { ++counter; }));
+
+	auto submit_time = Clock::now() - start;
+	for (auto& future : futures)
+		future.wait();
+
+	std::cout << "operator(): submit " << std::chrono::duration_cast<std::chrono::microseconds>(submit_time).count()
+		<< "us, total " << std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() << "us" << std::endl;
+
+	// in one batch
+	start = Clock::now();
+	auto done = taskmgr.bulk(tasks, [&counter](size_t) { ++counter; });
+	submit_time = Clock::now() - start;
+	done.wait();
+
+	std::cout << "bulk(): submit " << std::chrono::duration_cast<std::chrono::microseconds>(submit_time).count()
+		<< "us, total " << std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() << "us" << std::endl;
+
+	std::cout << "counter: " << counter << std::endl;
+}
+
+#ifdef RAZ_COROUTINES
+raz::Task<int> square(int value)
+{
+	co_return value * value;
+}
+
+raz::Task<int> sumOfSquares(raz::TaskManager& taskmgr, raz::Thread<Worker>& thread, int count)
+{
+	int sum = 0;
+	for (int i = 1; i <= count; ++i)
+		sum += co_await square(i);
+
+	// a future from the TaskManager, the coroutine continues on one of its workers
+	sum += co_await taskmgr([] { return 1000; });
+
+	// continue on the Worker thread, in order with its other calls
+	Worker& worker = co_await raz::resumeOn(thread);
+	worker(sum);
+
+	co_await raz::resumeOn(taskmgr);
+	co_return sum;
+}
+
+void example14()
+{
+	raz::TaskManager taskmgr;
+	raz::Thread<Worker> thread;
+	thread.start(1);
+
+	std::cout << "coroutine result: " << sumOfSquares(taskmgr, thread, 10).start(taskmgr).get() << std::endl;
+	thread.stop();
+}
+#else
+void example14()
+{
+	std::cout << "coroutines need C++20" << std::endl;
+}
+#endif
+
+void example15()
+{
+	raz::ChromeTrace trace;
+
+	raz::TaskManagerConfig config;
+	config.collect_stats = true;
+	config.trace_hook = std::ref(trace);
+	config.trace_sample_interval = 10;
+
+	{
+		raz::TaskManager taskmgr(config);
+
+		taskmgr.bulk(10000, [](size_t i)
+		{
+			volatile size_t sink = 0;
+			for (size_t j = 0; j < (i % 100) * 100; ++j)
+				sink = sink + j;
+		}).wait();
+
+		for (size_t i = 0; i < taskmgr.getWorkerCount(); ++i)
+		{
+			raz::WorkerStats stats = taskmgr.getWorkerStats(i);
+
+			// the bucket that contains the median enqueue-to-start latency
+			size_t median = 0;
+			for (uint64_t count = 0; median < raz::WorkerStats::BUCKETS; ++median)
+			{
+				count += stats.latency[median];
+				if (count * 2 >= stats.tasks_executed)
+					break;
+			}
+
+			std::cout << "worker " << i << ": " << stats.tasks_executed << " tasks, busy " << stats.busy_time_ns / 1000
+				<< "us, idle " << stats.idle_time_ns / 1000 << "us, steals " << stats.steals << "/" << stats.steal_attempts
+				<< ", median latency < " << (1ull << median) << "us" << std::endl;
+		}
+	}
+
+	// trace.save(path) writes the same into a file that chrome://tracing or Perfetto can open
+	std::ostringstream json;
+	trace.write(json);
+	std::cout << trace.size() << " sampled tasks traced, " << json.str().size() << " bytes of trace events" << std::endl;
+}
+
+void example16()
+{
+	raz::TaskManagerConfig config;
+	config.threads = 2;
+	config.queue_capacity = 64;
+	config.overflow_policy = raz::BLOCK;
+	raz::TaskManager taskmgr(config);
+
+	// the producer is slowed down to the speed of the workers instead of queueing the whole burst
+	std::atomic<int> done(0);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < 2000; ++i)
+	{
+		taskmgr([&done]
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+			++done;
+		});
+	}
+	auto submitted = std::chrono::steady_clock::now();
+
+	taskmgr.drain();
+	std::cout << "burst of 2000 tasks submitted in " << std::chrono::duration_cast<std::chrono::milliseconds>(submitted - start).count()
+		<< "ms, " << done << " done after drain" << std::endl;
+
+	taskmgr.shutdown();
+	try
+	{
+		taskmgr([] {});
+	}
+	catch (raz::TaskRejectedError& e)
+	{
+		std::cout << e.what() << std::endl;
+	}
+}
+
+void example17()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	raz::TaskManager taskmgr;
+	const auto created = Clock::now();
+	raz::Scheduler scheduler(taskmgr);
+
+	// the first timer fires in the last tick before the wheel's first cascade, the second one is cascaded from the upper level
+	std::atomic<long long> cascaded_late(-1);
+	const auto cascaded_due = created + std::chrono::milliseconds(300);
+	scheduler.scheduleAt(created + std::chrono::milliseconds(255), [] {});
+	scheduler.scheduleAt(cascaded_due, [&cascaded_late, cascaded_due]
+	{
+		cascaded_late = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - cascaded_due).count();
+	});
+
+	// the scheduler thread sleeps between the timers instead of polling a raz::Timer
+	std::atomic<int> heartbeats(0);
+	raz::TimerHandle heartbeat = scheduler.scheduleEvery(std::chrono::milliseconds(20), [&heartbeats] { ++heartbeats; });
+
+	std::atomic<int> fired(0);
+	std::vector<raz::TimerHandle> timeouts;
+	for (int i = 0; i < 10000; ++i)
+	{
+		// these timers may be late by 10ms, so they are grouped into a few wakeups
+		timeouts.push_back(scheduler.schedule(std::chrono::milliseconds(50 + i % 100), [&fired] { ++fired; }, std::chrono::milliseconds(10)));
+	}
+
+	// most connections respond in time, so their timeouts are cancelled
+	for (size_t i = 0; i < timeouts.size(); ++i)
+	{
+		if (i % 10 != 0)
+			timeouts[i].cancel();
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	heartbeat.cancel();
+
+	std::cout << heartbeats << " heartbeats, " << fired << " timeouts fired" << std::endl;
+
+	while (cascaded_late < 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	std::cout << "timer after the wheel boundary fired " << cascaded_late << "ms late" << std::endl;
+}
+
+void example18()
+{
+	raz::ThreadConfig config;
+	config.name = "raz-shard";
+	raz::ThreadGroup<AccountShard> shards(4, config);
+
+	std::future<void> stopped = shards.start();
+
+	// the deposits of an account are processed in order by the same thread
+	for (int i = 0; i < 10000; ++i)
+	{
+		std::string account = "account" + std::to_string(i % 100);
+		shards.call(account, account, 1);
+	}
+
+	std::vector<std::promise<int>> totals(shards.size());
+	for (size_t i = 0; i < shards.size(); ++i)
+		shards[i](std::ref(totals[i]));
+
+	int sum = 0;
+	for (auto& total : totals)
+		sum += total.get_future().get();
+
+	shards.stop();
+	stopped.get();
+
+	std::cout << "total balance of " << shards.size() << " shards: " << sum << std::endl;
+}
+
 int main()
 {
 	example01();
 	example02();
 	example03();
 	example04();
+	example05();
+	example06();
+	example07();
+	example08();
+	example09();
+	example10();
+	example11();
+	example12();
+	example13();
+	example14();
+	example15();
+	example16();
+	example17();
+	example18();
 
 	return 0;
 }
@@ -21,15 +21,229 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring> // memset & memcpy
 #include <iterator>
 #include <stdexcept>
+#include <utility> // std::forward
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h> // _BitScanForward
+#endif
 
 namespace raz
 {
+	class BitsetBase
+	{
+	protected:
+		static bool isset(const uint32_t* data, size_t pos)
+		{
+			return (data[pos / 32] & (1u << (pos % 32))) != 0;
+		}
+
+		static void set(uint32_t* data, size_t pos)
+		{
+			data[pos / 32] |= (1u << (pos % 32));
+		}
+
+		static void unset(uint32_t* data, size_t pos)
+		{
+			data[pos / 32] &= ~(1u << (pos % 32));
+		}
+
+		static void setRange(uint32_t* data, size_t pos, size_t count)
+		{
+			while (count > 0)
+			{
+				const size_t bits = getRangeBits(pos, count);
+				data[pos / 32] |= getRangeMask(pos, bits);
+				pos += bits;
+				count -= bits;
+			}
+		}
+
+		static void unsetRange(uint32_t* data, size_t pos, size_t count)
+		{
+			while (count > 0)
+			{
+				const size_t bits = getRangeBits(pos, count);
+				data[pos / 32] &= ~getRangeMask(pos, bits);
+				pos += bits;
+				count -= bits;
+			}
+		}
+
+		template<bool VALUE>
+		static size_t findNext(const uint32_t* data, size_t bits, size_t pos)
+		{
+			if (pos >= bits)
+				return bits;
+
+			// skip whole words that don't contain the value we are looking for
+			const size_t words = getWordCount(bits);
+			size_t index = pos / 32;
+			uint32_t word = (VALUE ? data[index] : ~data[index]) & (~0u << (pos % 32));
+
+			while (word == 0)
+			{
+				if (++index == words)
+					return bits;
+
+				word = VALUE ? data[index] : ~data[index];
+			}
+
+			const size_t result = index * 32 + countTrailingZeros(word);
+			return (result < bits) ? result : bits;
+		}
+
+		static size_t findFalseRange(const uint32_t* data, size_t bits, size_t count, size_t pos)
+		{
+			if (count <= 32)
+				return findShortFalseRange(data, bits, count, pos);
+
+			// longer runs are located by jumping from run to run, skipping whole words at once
+			while (pos < bits)
+			{
+				const size_t first = findNext<false>(data, bits, pos);
+				if (count > bits - first)
+					return bits;
+
+				const size_t last = findNext<true>(data, bits, first);
+				if (last - first >= count)
+					return first;
+
+				pos = last;
+			}
+
+			return bits;
+		}
+
+		static size_t getLongestFalseRange(const uint32_t* data, size_t bits)
+		{
+			size_t longest = 0;
+			size_t pos = findNext<false>(data, bits, 0);
+
+			while (pos < bits)
+			{
+				const size_t last = findNext<true>(data, bits, pos);
+				if (last - pos > longest)
+					longest = last - pos;
+
+				pos = findNext<false>(data, bits, last);
+			}
+
+			return longest;
+		}
+
+		template<class F>
+		static void forEachFalseRange(const uint32_t* data, size_t bits, F&& fn)
+		{
+			size_t pos = findNext<false>(data, bits, 0);
+
+			while (pos < bits)
+			{
+				const size_t last = findNext<true>(data, bits, pos);
+				fn(pos, last - pos);
+				pos = findNext<false>(data, bits, last);
+			}
+		}
+
+		static size_t countTrueBits(const uint32_t* data, size_t bits)
+		{
+			size_t count = 0;
+			const size_t words = getWordCount(bits);
+
+			for (size_t i = 0; i < words; ++i)
+				count += countTrueBits(data[i]);
+
+			return count;
+		}
+
+		static size_t countTrueBits(uint32_t x)
+		{
+			x = x - ((x >> 1) & 0x55555555);
+			x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+			x = (x + (x >> 4)) & 0x0F0F0F0F;
+			x = x + (x >> 8);
+			x = x + (x >> 16);
+			return x & 0x0000003F;
+		}
+
+		static constexpr size_t getWordCount(size_t bits)
+		{
+			return (bits == 0) ? 1 : ((bits - 1) / 32) + 1;
+		}
+
+	private:
+		static size_t findShortFalseRange(const uint32_t* data, size_t bits, size_t count, size_t pos)
+		{
+			if (count == 0)
+				return (pos < bits) ? pos : bits;
+
+			const size_t words = getWordCount(bits);
+
+			for (size_t index = pos / 32; index < words; ++index)
+			{
+				// look at a 64 bit window so runs crossing the word boundary are found too
+				uint64_t window = getFalseBitsOfWord(data, bits, index) | (static_cast<uint64_t>(getFalseBitsOfWord(data, bits, index + 1)) << 32);
+				if (index == pos / 32)
+					window &= (~0ull << (pos % 32));
+
+				// keep the bits that are followed by at least count-1 false bits
+				for (size_t length = 1; length < count && window; )
+				{
+					const size_t shift = (length < count - length) ? length : count - length;
+					window &= (window >> shift);
+					length += shift;
+				}
+
+				const uint32_t starts = static_cast<uint32_t>(window);
+				if (starts)
+					return index * 32 + countTrailingZeros(starts);
+			}
+
+			return bits;
+		}
+
+		static uint32_t getFalseBitsOfWord(const uint32_t* data, size_t bits, size_t index)
+		{
+			const size_t words = getWordCount(bits);
+
+			if (index >= words)
+				return 0;
+			else if (index == words - 1 && (bits % 32) != 0)
+				return ~data[index] & ((1u << (bits % 32)) - 1);
+			else
+				return ~data[index];
+		}
+
+		static size_t getRangeBits(size_t pos, size_t count)
+		{
+			const size_t bits_left_in_word = 32 - (pos % 32);
+			return (count < bits_left_in_word) ? count : bits_left_in_word;
+		}
+
+		static uint32_t getRangeMask(size_t pos, size_t bits)
+		{
+			return (bits == 32) ? ~0u : (((1u << bits) - 1) << (pos % 32));
+		}
+
+		static size_t countTrailingZeros(uint32_t x)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, x);
+			return index;
+#else
+			return __builtin_ctz(x);
+#endif
+		}
+	};
+
 	template<size_t N>
-	class Bitset
+	class Bitset : public BitsetBase
 	{
 	public:
 		class TrueBitIterator : public std::iterator<std::input_iterator_tag, size_t, size_t, const size_t*, size_t>
@@ -225,12 +439,7 @@ namespace raz
 
 			size_t count() const
 			{
-				size_t count = 0;
-
-				for (size_t i = 0; i < DATA_SIZE; ++i)
-					count += countTrueBits(m_bitset->m_data[i]);
-
-				return count;
+				return countTrueBits(m_bitset->m_data, N);
 			}
 
 			TrueBitIterator begin() const
@@ -262,12 +471,7 @@ namespace raz
 
 			size_t count() const
 			{
-				size_t count = 0;
-
-				for (size_t i = 0; i < DATA_SIZE; ++i)
-					count += countTrueBits(m_bitset->m_data[i]);
-
-				return (N - count);
+				return (N - countTrueBits(m_bitset->m_data, N));
 			}
 
 			FalseBitIterator begin() const
@@ -309,25 +513,71 @@ namespace raz
 		bool isset(size_t pos) const
 		{
 			if (pos >= N)
-				throw std::out_of_range({});
+				throw std::out_of_range("bit position out of range");
 
-			return (m_data[pos / 32] & (1u << (pos % 32))) != 0;
+			return BitsetBase::isset(m_data, pos);
 		}
 
 		void set(size_t pos)
 		{
 			if (pos >= N)
-				throw std::out_of_range({});
+				throw std::out_of_range("bit position out of range");
 
-			m_data[pos / 32] |= (1u << (pos % 32));
+			BitsetBase::set(m_data, pos);
 		}
 
 		void unset(size_t pos)
 		{
 			if (pos >= N)
-				throw std::out_of_range({});
+				throw std::out_of_range("bit position out of range");
+
+			BitsetBase::unset(m_data, pos);
+		}
+
+		void setRange(size_t pos, size_t count)
+		{
+			if (pos > N || count > N - pos)
+				throw std::out_of_range("bit range doesn't fit into the bitset");
+
+			BitsetBase::setRange(m_data, pos, count);
+		}
+
+		void unsetRange(size_t pos, size_t count)
+		{
+			if (pos > N || count > N - pos)
+				throw std::out_of_range("bit range doesn't fit into the bitset");
+
+			BitsetBase::unsetRange(m_data, pos, count);
+		}
+
+		// returns N if there are no more true bits
+		size_t findNextTrue(size_t pos = 0) const
+		{
+			return BitsetBase::findNext<true>(m_data, N, pos);
+		}
+
+		// returns N if there are no more false bits
+		size_t findNextFalse(size_t pos = 0) const
+		{
+			return BitsetBase::findNext<false>(m_data, N, pos);
+		}
 
-			m_data[pos / 32] &= ~(1u << (pos % 32));
+		// returns the position of the first run of 'count' false bits, or N if there is no such run
+		size_t findFalseRange(size_t count, size_t pos = 0) const
+		{
+			return BitsetBase::findFalseRange(m_data, N, count, pos);
+		}
+
+		size_t getLongestFalseRange() const
+		{
+			return BitsetBase::getLongestFalseRange(m_data, N);
+		}
+
+		// calls fn(pos, count) for every maximal run of false bits
+		template<class F>
+		void forEachFalseRange(F&& fn) const
+		{
+			BitsetBase::forEachFalseRange(m_data, N, std::forward<F>(fn));
 		}
 
 		void reset()
@@ -363,17 +613,111 @@ namespace raz
 		}
 
 	private:
-		static constexpr size_t DATA_SIZE = ((N - 1) / 32) + 1;
+		static constexpr size_t DATA_SIZE = getWordCount(N);
 		uint32_t m_data[DATA_SIZE];
+	};
 
-		static size_t countTrueBits(uint32_t x)
+	class DynamicBitset : public BitsetBase
+	{
+	public:
+		DynamicBitset(size_t bits = 0) :
+			m_bits(bits),
+			m_data(getWordCount(bits), 0)
 		{
-			x = x - ((x >> 1) & 0x55555555);
-			x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
-			x = (x + (x >> 4)) & 0x0F0F0F0F;
-			x = x + (x >> 8);
-			x = x + (x >> 16);
-			return x & 0x0000003F;
 		}
+
+		bool isset(size_t pos) const
+		{
+			if (pos >= m_bits)
+				throw std::out_of_range("bit position out of range");
+
+			return BitsetBase::isset(m_data.data(), pos);
+		}
+
+		void set(size_t pos)
+		{
+			if (pos >= m_bits)
+				throw std::out_of_range("bit position out of range");
+
+			BitsetBase::set(m_data.data(), pos);
+		}
+
+		void unset(size_t pos)
+		{
+			if (pos >= m_bits)
+				throw std::out_of_range("bit position out of range");
+
+			BitsetBase::unset(m_data.data(), pos);
+		}
+
+		void setRange(size_t pos, size_t count)
+		{
+			if (pos > m_bits || count > m_bits - pos)
+				throw std::out_of_range("bit range doesn't fit into the bitset");
+
+			BitsetBase::setRange(m_data.data(), pos, count);
+		}
+
+		void unsetRange(size_t pos, size_t count)
+		{
+			if (pos > m_bits || count > m_bits - pos)
+				throw std::out_of_range("bit range doesn't fit into the bitset");
+
+			BitsetBase::unsetRange(m_data.data(), pos, count);
+		}
+
+		// returns bits() if there are no more true bits
+		size_t findNextTrue(size_t pos = 0) const
+		{
+			return BitsetBase::findNext<true>(m_data.data(), m_bits, pos);
+		}
+
+		// returns bits() if there are no more false bits
+		size_t findNextFalse(size_t pos = 0) const
+		{
+			return BitsetBase::findNext<false>(m_data.data(), m_bits, pos);
+		}
+
+		// returns the position of the first run of 'count' false bits, or bits() if there is no such run
+		size_t findFalseRange(size_t count, size_t pos = 0) const
+		{
+			return BitsetBase::findFalseRange(m_data.data(), m_bits, count, pos);
+		}
+
+		size_t getLongestFalseRange() const
+		{
+			return BitsetBase::getLongestFalseRange(m_data.data(), m_bits);
+		}
+
+		// calls fn(pos, count) for every maximal run of false bits
+		template<class F>
+		void forEachFalseRange(F&& fn) const
+		{
+			BitsetBase::forEachFalseRange(m_data.data(), m_bits, std::forward<F>(fn));
+		}
+
+		size_t countTrueBits() const
+		{
+			return BitsetBase::countTrueBits(m_data.data(), m_bits);
+		}
+
+		size_t countFalseBits() const
+		{
+			return (m_bits - countTrueBits());
+		}
+
+		void reset()
+		{
+			std::fill(m_data.begin(), m_data.end(), 0);
+		}
+
+		size_t bits() const
+		{
+			return m_bits;
+		}
+
+	private:
+		size_t m_bits;
+		std::vector<uint32_t> m_data;
 	};
 }
@@ -0,0 +1,747 @@
+/*
+Copyright (C) Gbor "Razzie" Grzsny
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
+*/
+
+#pragma once
+
+// coroutines need C++20
+#if (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)) && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#define RAZ_COROUTINES 1
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "raz/memory.hpp"
+#include "raz/thread.hpp"
+
+namespace raz
+{
+	template<class T = void>
+	class Task;
+
+	namespace detail
+	{
+		inline IMemoryPool* findFrameMemoryPool()
+		{
+			return nullptr;
+		}
+
+		// the first IMemoryPool* or TaskManager& parameter of the coroutine decides where its frame goes
+		template<class Arg, class... Args>
+		IMemoryPool* findFrameMemoryPool(Arg& arg, Args&... args)
+		{
+			if constexpr (std::is_convertible_v<Arg&, IMemoryPool*>)
+				return arg;
+			else if constexpr (std::is_same_v<std::remove_cv_t<Arg>, TaskManager>)
+				return arg.getMemoryPool();
+			else
+				return findFrameMemoryPool(args...);
+		}
+
+		class TaskPromiseBase
+		{
+		public:
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				template<class Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+				{
+					return handle.promise().onFinished();
+				}
+
+				void await_resume() noexcept
+				{
+				}
+			};
+
+			// tasks don't run until they are awaited or started
+			std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			FinalAwaiter final_suspend() noexcept
+			{
+				return {};
+			}
+
+			void unhandled_exception()
+			{
+				m_exception = std::current_exception();
+			}
+
+			std::coroutine_handle<> getHandle() const
+			{
+				return m_handle;
+			}
+
+			TaskManager* getExecutor() const
+			{
+				return m_executor;
+			}
+
+			void setExecutor(TaskManager* executor)
+			{
+				m_executor = executor;
+			}
+
+			void setContinuation(std::coroutine_handle<> continuation)
+			{
+				m_continuation = continuation;
+			}
+
+		protected:
+			std::coroutine_handle<> m_handle; // set by TaskFramePromise
+			TaskManager* m_executor = nullptr;
+			std::coroutine_handle<> m_continuation;
+			std::exception_ptr m_exception;
+
+			void rethrowException()
+			{
+				if (m_exception)
+					std::rethrow_exception(m_exception);
+			}
+
+			// the pool is stored in front of the frame, so it can be freed the same way
+			static void* allocateFrame(size_t size, IMemoryPool* memory)
+			{
+				Block* frame = raz::Allocator<Block>(memory).allocate(getBlockCount(size));
+				std::memcpy(frame, &memory, sizeof(IMemoryPool*));
+				return frame + 1;
+			}
+
+			static void freeFrame(void* ptr, size_t size)
+			{
+				Block* frame = static_cast<Block*>(ptr) - 1;
+				IMemoryPool* memory;
+				std::memcpy(&memory, frame, sizeof(IMemoryPool*));
+
+				raz::Allocator<Block>(memory).deallocate(frame, getBlockCount(size));
+			}
+
+		private:
+			typedef std::max_align_t Block;
+
+			// +1 for the header
+			static size_t getBlockCount(size_t size)
+			{
+				return ((size + sizeof(Block) - 1) / sizeof(Block) + 1);
+			}
+		};
+
+		template<class T>
+		class TaskPromise : public TaskPromiseBase
+		{
+		public:
+			template<class U>
+			void return_value(U&& value)
+			{
+				m_value.emplace(std::forward<U>(value));
+			}
+
+			T getResult()
+			{
+				rethrowException();
+				return std::move(*m_value);
+			}
+
+			void detach(Promise<T>&& promise)
+			{
+				m_promise.emplace(std::move(promise));
+			}
+
+			// resumes the awaiting coroutine, or completes the future of a started task and frees the frame
+			std::coroutine_handle<> onFinished() noexcept
+			{
+				if (m_continuation)
+					return m_continuation;
+
+				Promise<T> promise(std::move(*m_promise));
+				std::exception_ptr exception = m_exception;
+				std::optional<T> value(std::move(m_value));
+				m_handle.destroy();
+
+				if (exception)
+					promise.setException(exception);
+				else
+					promise.setValue(std::move(*value));
+
+				return std::noop_coroutine();
+			}
+
+		private:
+			std::optional<T> m_value;
+			std::optional<Promise<T>> m_promise;
+		};
+
+		template<>
+		class TaskPromise<void> : public TaskPromiseBase
+		{
+		public:
+			void return_void()
+			{
+			}
+
+			void getResult()
+			{
+				rethrowException();
+			}
+
+			void detach(Promise<void>&& promise)
+			{
+				m_promise.emplace(std::move(promise));
+			}
+
+			std::coroutine_handle<> onFinished() noexcept
+			{
+				if (m_continuation)
+					return m_continuation;
+
+				Promise<void> promise(std::move(*m_promise));
+				std::exception_ptr exception = m_exception;
+				m_handle.destroy();
+
+				if (exception)
+					promise.setException(exception);
+				else
+					promise.setValue();
+
+				return std::noop_coroutine();
+			}
+
+		private:
+			std::optional<Promise<void>> m_promise;
+		};
+
+		// the promise of a coroutine with the parameters Args (see std::coroutine_traits below)
+		// the frame allocation functions aren't templates, so GCC doesn't take them for a mismatched new/delete pair
+		template<class T, class... Args>
+		class TaskFramePromise : public TaskPromise<T>
+		{
+		public:
+			Task<T> get_return_object()
+			{
+				this->m_handle = std::coroutine_handle<TaskFramePromise>::from_promise(*this);
+				return Task<T>(this);
+			}
+
+			// the first IMemoryPool* or TaskManager& parameter decides where the frame goes (without one it's also the operator new(size_t))
+			static void* operator new(size_t size, Args&... args)
+			{
+				return TaskPromiseBase::allocateFrame(size, findFrameMemoryPool(args...));
+			}
+
+			static void operator delete(void* ptr, size_t size)
+			{
+				TaskPromiseBase::freeFrame(ptr, size);
+			}
+		};
+
+		template<class Promise>
+		TaskManager* getExecutor(std::coroutine_handle<Promise> handle)
+		{
+			if constexpr (std::is_base_of_v<TaskPromiseBase, Promise>)
+				return handle.promise().getExecutor();
+			else
+				return nullptr;
+		}
+	}
+
+	// a lazily started coroutine, co_await it from another coroutine or start() it on a TaskManager
+	// awaited tasks run on the executor of the awaiting task, unless they were moved with resumeOn()
+	template<class T>
+	class Task
+	{
+	public:
+		Task() = default;
+
+		explicit Task(detail::TaskPromise<T>* promise) :
+			m_promise(promise)
+		{
+		}
+
+		Task(const Task&) = delete;
+
+		Task(Task&& other) noexcept :
+			m_promise(std::exchange(other.m_promise, nullptr))
+		{
+		}
+
+		~Task()
+		{
+			if (m_promise)
+				m_promise->getHandle().destroy();
+		}
+
+		Task& operator=(const Task&) = delete;
+
+		Task& operator=(Task&& other) noexcept
+		{
+			Task tmp(std::move(other));
+			std::swap(m_promise, tmp.m_promise);
+			return *this;
+		}
+
+		bool valid() const
+		{
+			return (m_promise != nullptr);
+		}
+
+		// runs the task on 'taskmgr', the task object becomes empty and the coroutine frees itself when it's done
+		Future<T> start(TaskManager& taskmgr, TaskPriority priority = NORMAL)
+		{
+			if (!m_promise)
+				throw std::future_error(std::future_errc::no_state);
+
+			auto task = std::exchange(m_promise, nullptr);
+			auto handle = task->getHandle();
+			Promise<T> promise(taskmgr.getMemoryPool(), &taskmgr);
+			Future<T> future = promise.getFuture();
+
+			task->setExecutor(&taskmgr);
+			task->detach(std::move(promise));
+			taskmgr.post([handle] { handle.resume(); }, priority);
+			return future;
+		}
+
+		class Awaiter
+		{
+		public:
+			explicit Awaiter(detail::TaskPromise<T>* promise) :
+				m_promise(promise)
+			{
+			}
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			template<class Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+			{
+				m_promise->setContinuation(awaiting);
+				if (!m_promise->getExecutor())
+					m_promise->setExecutor(detail::getExecutor(awaiting));
+
+				return m_promise->getHandle();
+			}
+
+			T await_resume()
+			{
+				return m_promise->getResult();
+			}
+
+		private:
+			detail::TaskPromise<T>* m_promise;
+		};
+
+		Awaiter operator co_await() const
+		{
+			if (!m_promise)
+				throw std::future_error(std::future_errc::no_state);
+
+			return Awaiter(m_promise);
+		}
+
+	private:
+		detail::TaskPromise<T>* m_promise = nullptr;
+	};
+
+	// the coroutine resumes on the executor of the awaiting task, or the one of the future if there is none
+	// (or on the thread that makes the future ready if neither of them has an executor)
+	template<class R>
+	class FutureAwaiter
+	{
+	public:
+		explicit FutureAwaiter(const Future<R>& future) :
+			m_future(future)
+		{
+		}
+
+		bool await_ready() const
+		{
+			return m_future.isReady();
+		}
+
+		template<class Promise>
+		void await_suspend(std::coroutine_handle<Promise> handle)
+		{
+			TaskManager* executor = detail::getExecutor(handle);
+			if (!executor)
+				executor = m_future.getExecutor();
+
+			// the coroutine (and this awaiter) may be gone by the time onReady() returns
+			Future<R> future = m_future;
+			future.onReady([handle, executor](const Future<R>&)
+			{
+				if (executor)
+					executor->post([handle] { handle.resume(); });
+				else
+					handle.resume();
+			});
+		}
+
+		auto await_resume() const
+		{
+			return m_future.get();
+		}
+
+	private:
+		Future<R> m_future;
+	};
+
+	template<class R>
+	FutureAwaiter<R> operator co_await(const Future<R>& future)
+	{
+		return FutureAwaiter<R>(future);
+	}
+
+	class TaskManagerAwaiter
+	{
+	public:
+		TaskManagerAwaiter(TaskManager& taskmgr, TaskPriority priority) :
+			m_taskmgr(taskmgr),
+			m_priority(priority)
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		template<class Promise>
+		void await_suspend(std::coroutine_handle<Promise> handle)
+		{
+			if constexpr (std::is_base_of_v<detail::TaskPromiseBase, Promise>)
+				handle.promise().setExecutor(&m_taskmgr);
+
+			m_taskmgr.post([handle] { handle.resume(); }, m_priority);
+		}
+
+		void await_resume() const noexcept
+		{
+		}
+
+	private:
+		TaskManager& m_taskmgr;
+		TaskPriority m_priority;
+	};
+
+	// continues the coroutine on a worker of 'taskmgr', which also becomes the executor of the task
+	inline TaskManagerAwaiter resumeOn(TaskManager& taskmgr, TaskPriority priority = NORMAL)
+	{
+		return TaskManagerAwaiter(taskmgr, priority);
+	}
+
+	template<class T>
+	class ThreadAwaiter
+	{
+	public:
+		explicit ThreadAwaiter(Thread<T>& thread) :
+			m_thread(thread),
+			m_object(nullptr)
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_thread.post([this, handle](T& object)
+			{
+				m_object = &object;
+				handle.resume();
+			});
+		}
+
+		T& await_resume() const noexcept
+		{
+			return *m_object;
+		}
+
+	private:
+		Thread<T>& m_thread;
+		T* m_object;
+	};
+
+	// continues the coroutine on 'thread' in order with its other calls, co_await returns the object of the thread
+	// the coroutine stays on the thread until its next co_await, and it's never resumed if the thread drops its calls
+	template<class T>
+	ThreadAwaiter<T> resumeOn(Thread<T>& thread)
+	{
+		return ThreadAwaiter<T>(thread);
+	}
+
+	namespace detail
+	{
+		// a coroutine waiting in NetworkPoller
+		class NetworkWait
+		{
+		public:
+			virtual ~NetworkWait() = default;
+
+			// returns true if the wait is over (data arrived, something else happened, or the deadline passed)
+			// with 0 timeout only arrived data and the deadline count, other events look the same as no event
+			virtual bool poll(uint32_t timeout_ms) = 0;
+
+			std::chrono::steady_clock::time_point deadline;
+			std::coroutine_handle<> handle;
+			std::exception_ptr exception;
+		};
+	}
+
+	// the network backends can only wait by blocking, so their waits run on this thread instead of the TaskManager workers,
+	// and the coroutines are resumed on the TaskManager when the waits are over
+	// every round checks all pending waits without blocking, and only if none of them had data (or timed out), the poller
+	// blocks for at most 'slice_ms' on one of them, taking turns
+	// so data is noticed within about 'slice_ms', but events without data (like a new or closed connection) can take
+	// up to N * 'slice_ms' with N pending waits, since those are only seen by a blocking wait
+	class NetworkPoller
+	{
+	public:
+		NetworkPoller(TaskManager& taskmgr, uint32_t slice_ms = 10, TaskPriority priority = NORMAL) :
+			m_taskmgr(taskmgr),
+			m_slice_ms((slice_ms > 0) ? slice_ms : 1),
+			m_priority(priority),
+			m_exit(false)
+		{
+			ThreadConfig config;
+			config.name = "raz-poller";
+			m_thread = NativeThread(config, &NetworkPoller::run, this);
+		}
+
+		NetworkPoller(const NetworkPoller&) = delete;
+
+		NetworkPoller& operator=(const NetworkPoller&) = delete;
+
+		// the pending waits receive a broken_promise error
+		~NetworkPoller()
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_exit = true;
+				m_notifier.notify_all();
+			}
+
+			m_thread.join();
+
+			for (auto wait : m_pending)
+			{
+				wait->exception = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+				resume(wait);
+			}
+		}
+
+		TaskManager& getTaskManager() const
+		{
+			return m_taskmgr;
+		}
+
+		void add(detail::NetworkWait* wait)
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_pending.push_back(wait);
+			m_notifier.notify_one();
+		}
+
+	private:
+		TaskManager& m_taskmgr;
+		uint32_t m_slice_ms;
+		TaskPriority m_priority;
+		bool m_exit;
+		std::vector<detail::NetworkWait*> m_pending;
+		std::mutex m_mutex;
+		std::condition_variable m_notifier;
+		NativeThread m_thread;
+
+		void resume(detail::NetworkWait* wait)
+		{
+			m_taskmgr.post([handle = wait->handle] { handle.resume(); }, m_priority);
+		}
+
+		void run()
+		{
+			std::vector<detail::NetworkWait*> waits;
+			size_t turn = 0;
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			for (;;)
+			{
+				m_notifier.wait(lock, [this] { return (m_exit || !m_pending.empty()); });
+				if (m_exit)
+					return;
+
+				// the waits added in the meantime are polled in the next round
+				waits.swap(m_pending);
+				lock.unlock();
+
+				bool resumed = false;
+				size_t kept = 0;
+				for (auto wait : waits)
+				{
+					if (wait->poll(0))
+					{
+						resume(wait);
+						resumed = true;
+					}
+					else
+					{
+						waits[kept++] = wait;
+					}
+				}
+
+				waits.resize(kept);
+
+				if (!resumed && !waits.empty())
+				{
+					const size_t index = turn++ % waits.size();
+					detail::NetworkWait* wait = waits[index];
+
+					const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(wait->deadline - std::chrono::steady_clock::now()).count();
+					const uint32_t timeout_ms = static_cast<uint32_t>(std::clamp<long long>(remaining, 0, m_slice_ms));
+
+					if (wait->poll(timeout_ms))
+					{
+						resume(wait);
+						waits.erase(waits.begin() + index);
+					}
+				}
+
+				lock.lock();
+				m_pending.insert(m_pending.begin(), waits.begin(), waits.end());
+				waits.clear();
+			}
+		}
+	};
+
+	template<class Backend, class... Args>
+	class NetworkAwaiter : private detail::NetworkWait
+	{
+	public:
+		template<class... CArgs>
+		NetworkAwaiter(NetworkPoller& poller, Backend& backend, uint32_t timeout_ms, CArgs&&... args) :
+			m_poller(poller),
+			m_backend(backend),
+			m_timeout_ms(timeout_ms),
+			m_args(std::forward<CArgs>(args)...),
+			m_result(0)
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		template<class Promise>
+		void await_suspend(std::coroutine_handle<Promise> handle)
+		{
+			if constexpr (std::is_base_of_v<detail::TaskPromiseBase, Promise>)
+				handle.promise().setExecutor(&m_poller.getTaskManager());
+
+			this->handle = handle;
+			this->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_timeout_ms);
+			m_poller.add(this);
+		}
+
+		size_t await_resume()
+		{
+			if (this->exception)
+				std::rethrow_exception(this->exception);
+
+			return m_result;
+		}
+
+	private:
+		NetworkPoller& m_poller;
+		Backend& m_backend;
+		uint32_t m_timeout_ms;
+		std::tuple<Args...> m_args;
+		size_t m_result;
+
+		virtual bool poll(uint32_t timeout_ms)
+		{
+			const auto started = std::chrono::steady_clock::now();
+
+			try
+			{
+				m_result = std::apply([this, timeout_ms](auto&... args) { return m_backend.wait(args..., timeout_ms); }, m_args);
+			}
+			catch (...)
+			{
+				this->exception = std::current_exception();
+				return true;
+			}
+
+			// a wait that returns well before its timeout saw an event even without data, like a new or closed connection
+			const auto now = std::chrono::steady_clock::now();
+			const bool returned_early = (timeout_ms > 0 && (now - started) * 2 < std::chrono::milliseconds(timeout_ms));
+			return (m_result > 0 || returned_early || now >= this->deadline);
+		}
+	};
+
+	// waits for incoming data with backend.wait(args..., timeout) on the thread of 'poller' and continues on its TaskManager,
+	// co_await returns the number of available bytes (0 on timeout)
+	// works with the TCP and UDP client and server backends, e.g.:
+	//   size_t len = co_await raz::waitReadable(poller, client_backend, 10);
+	//   size_t len = co_await raz::waitReadable(poller, server_backend, 10, std::ref(client), std::ref(state));
+	template<class Backend, class... Args>
+	NetworkAwaiter<Backend, std::decay_t<Args>...> waitReadable(NetworkPoller& poller, Backend& backend, uint32_t timeout_ms, Args&&... args)
+	{
+		return NetworkAwaiter<Backend, std::decay_t<Args>...>(poller, backend, timeout_ms, std::forward<Args>(args)...);
+	}
+}
+
+namespace std
+{
+	// every raz::Task coroutine gets a promise of its own parameters, see TaskFramePromise
+	template<class T, class... Args>
+	struct coroutine_traits<raz::Task<T>, Args...>
+	{
+		typedef raz::detail::TaskFramePromise<T, Args...> promise_type;
+	};
+}
+
+#endif
+#endif
@@ -21,11 +21,13 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <typeindex>
 #include <vector>
 #include "raz/thread.hpp"
@@ -38,32 +40,55 @@ namespace raz
 		EventDispatcher(TaskManager* taskmgr, IMemoryPool* memory = nullptr) :
 			m_taskmgr(taskmgr),
 			m_memory(memory),
-			m_handlers(memory)
+			m_table(nullptr),
+			m_epoch(0),
+			m_retired(nullptr),
+			m_draining(nullptr),
+			m_retired_tables(0)
 		{
-
+			m_readers[0] = 0;
+			m_readers[1] = 0;
+			m_table = createTable(nullptr);
 		}
 
+		// events must not be dispatched while the dispatcher is destroyed
 		~EventDispatcher()
 		{
 			std::lock_guard<std::mutex> guard(m_mutex);
-			for (auto& handler_list : m_handlers)
+			HandlerTable* table = m_table.load();
+			for (auto& handler_list : table->handlers)
 			{
 				for (auto& handler : handler_list.second)
 				{
 					handler->onDispatcherDestroyed();
 				}
 			}
+
+			destroyTable(table);
+			destroyTables(m_retired);
+			destroyTables(m_draining);
 		}
 
+		// the handlers are looked up in an immutable snapshot of the handler table, so dispatching never waits for a lock
+		// and it runs in parallel with other dispatches and with bind/unbind
 		template<class Event>
 		void operator()(Event event)
 		{
-			std::unique_lock<std::mutex> lock(m_mutex);
-			auto& handlers = getEventHandlerList(typeid(Event));
+			ReadGuard reader(*this);
+			auto it = reader.table->handlers.find(typeid(Event));
+			if (it == reader.table->handlers.end())
+				return;
+
+			auto& handlers = it->second;
 
 			if (m_taskmgr)
 			{
-				for (auto& handler : handlers)
+				// submitting can block (TaskManager backpressure), so the table isn't held meanwhile,
+				// otherwise a handler that binds or unbinds on a worker would wait for this dispatch in waitForReaders()
+				EventHandlerList handlers_copy(handlers, raz::Allocator<EventHandlerPtr>(m_memory));
+				reader.leave();
+
+				for (auto& handler : handlers_copy)
 				{
 					auto ptr = std::static_pointer_cast<EventHandler<Event>>(handler);
 					m_taskmgr->operator()(ptr, event);
@@ -71,7 +96,7 @@ namespace raz
 			}
 			else
 			{
-				std::vector<std::shared_future<void>, raz::Allocator<std::shared_future<void>>> tasks(m_memory);
+				std::vector<raz::Future<void>, raz::Allocator<raz::Future<void>>> tasks(m_memory);
 
 				for (auto& handler : handlers)
 				{
@@ -79,7 +104,7 @@ namespace raz
 					tasks.push_back(TaskManager::pack(ptr, event));
 				}
 
-				lock.unlock();
+				reader.leave();
 
 				for (auto& task : tasks)
 					task.wait();
@@ -169,61 +194,277 @@ namespace raz
 		typedef std::shared_ptr<IEventHandler> EventHandlerPtr;
 		typedef std::vector<EventHandlerPtr, raz::Allocator<EventHandlerPtr>> EventHandlerList;
 
-		std::mutex m_mutex;
+		// never modified once it's published
+		struct HandlerTable
+		{
+			HandlerTable(IMemoryPool* memory) :
+				handlers(memory)
+			{
+			}
+
+			HandlerTable(const HandlerTable& other) :
+				handlers(other.handlers)
+			{
+			}
+
+			std::map<std::type_index, EventHandlerList,
+				     std::less<std::type_index>,
+				     raz::Allocator<std::pair<const std::type_index, EventHandlerList>>> handlers;
+			HandlerTable* next_retired = nullptr;
+		};
+
+		// the table can't be reclaimed while there are readers in its epoch
+		struct ReadGuard
+		{
+			EventDispatcher& dispatcher;
+			HandlerTable* table;
+			std::atomic<size_t>* readers;
+
+			ReadGuard(EventDispatcher& dispatcher) :
+				dispatcher(dispatcher)
+			{
+				// the counter is incremented before loading the table, so a writer that sees no readers in this epoch can't reclaim it
+				for (;;)
+				{
+					const size_t epoch = dispatcher.m_epoch.load();
+					readers = &dispatcher.m_readers[epoch & 1];
+					readers->fetch_add(1);
+
+					if (dispatcher.m_epoch.load() == epoch)
+						break;
+
+					// the epoch changed in the meantime, this counter may belong to an epoch that is draining
+					readers->fetch_sub(1);
+				}
+
+				table = dispatcher.m_table.load();
+				++readDepth();
+			}
+
+			~ReadGuard()
+			{
+				leave();
+			}
+
+			void leave()
+			{
+				if (!readers)
+					return;
+
+				std::atomic<size_t>* epoch_readers = readers;
+				readers = nullptr;
+				table = nullptr;
+				--readDepth();
+
+				if (epoch_readers->fetch_sub(1) == 1 && dispatcher.m_retired_tables.load() > 0)
+				{
+					// the last reader of an epoch frees the retired tables, unless a writer is busy (it will do it instead)
+					std::unique_lock<std::mutex> lock(dispatcher.m_mutex, std::try_to_lock);
+					if (lock.owns_lock())
+						dispatcher.reclaim();
+				}
+			}
+		};
+
+		enum : size_t { MAX_RETIRED_TABLES = 64 };
+
+		std::mutex m_mutex; // writers
 		TaskManager* m_taskmgr;
 		IMemoryPool* m_memory;
-		std::map<std::type_index, EventHandlerList,
-			     std::less<std::type_index>,
-			     raz::Allocator<std::pair<const std::type_index, EventHandlerList>>> m_handlers;
+		std::atomic<HandlerTable*> m_table;
+		std::atomic<size_t> m_epoch;
+		std::atomic<size_t> m_readers[2]; // readers of the current and the previous epoch
+		HandlerTable* m_retired;  // replaced in the current epoch, readers of the current and the previous epoch may still use them
+		HandlerTable* m_draining; // replaced before the current epoch, only readers of the previous epoch may still use them
+		std::atomic<size_t> m_retired_tables;
+
+		HandlerTable* createTable(const HandlerTable* source)
+		{
+			raz::Allocator<HandlerTable> alloc(m_memory);
+			HandlerTable* table = alloc.allocate(1);
+
+			try
+			{
+				if (source)
+					new (table) HandlerTable(*source);
+				else
+					new (table) HandlerTable(m_memory);
+			}
+			catch (...)
+			{
+				alloc.deallocate(table, 1);
+				throw;
+			}
 
-		EventHandlerList& getEventHandlerList(std::type_index evt_type)
+			return table;
+		}
+
+		void destroyTable(HandlerTable* table)
 		{
-			auto it = m_handlers.find(evt_type);
-			if (it == m_handlers.end())
+			raz::Allocator<HandlerTable> alloc(m_memory);
+			table->~HandlerTable();
+			alloc.deallocate(table, 1);
+		}
+
+		// modify(table) returns false if there is nothing to change
+		// m_mutex has to be locked
+		template<class Modify>
+		void update(Modify modify)
+		{
+			HandlerTable* table = createTable(m_table.load());
+
+			try
 			{
-				return m_handlers.emplace(evt_type, m_memory).first->second;
+				if (!modify(*table))
+				{
+					destroyTable(table);
+					return;
+				}
 			}
-			else
+			catch (...)
 			{
-				return it->second;
+				destroyTable(table);
+				throw;
 			}
+
+			HandlerTable* old_table = m_table.exchange(table);
+			old_table->next_retired = m_retired;
+			m_retired = old_table;
+			m_retired_tables.fetch_add(1);
+
+			reclaim();
+		}
+
+		// the number of dispatches the current thread is in (of any dispatcher)
+		static size_t& readDepth()
+		{
+			static thread_local size_t depth = 0;
+			return depth;
+		}
+
+		// a reader that is preempted for long keeps every table replaced in the meantime alive,
+		// so writers wait for it when there are too many of them
+		// the wait is skipped in handlers that run during a dispatch, since the dispatch can't finish before them
+		void waitForReaders()
+		{
+			if (readDepth() > 0)
+				return;
+
+			while (m_retired_tables.load() > MAX_RETIRED_TABLES)
+			{
+				{
+					std::lock_guard<std::mutex> guard(m_mutex);
+					reclaim();
+					if (m_retired_tables.load() <= MAX_RETIRED_TABLES)
+						return;
+				}
+
+				std::this_thread::yield();
+			}
+		}
+
+		void destroyTables(HandlerTable* tables)
+		{
+			while (HandlerTable* table = tables)
+			{
+				tables = table->next_retired;
+				destroyTable(table);
+			}
+		}
+
+		// readers keep arriving in the current epoch, so the retired tables are moved to a new epoch
+		// and freed once the readers of the old one are gone
+		// m_mutex has to be locked
+		void reclaim()
+		{
+			for (;;)
+			{
+				const size_t epoch = m_epoch.load();
+
+				if (m_draining)
+				{
+					if (m_readers[(epoch - 1) & 1].load() > 0)
+						return;
+
+					size_t count = 0;
+					for (HandlerTable* table = m_draining; table; table = table->next_retired)
+						++count;
+
+					destroyTables(m_draining);
+					m_draining = nullptr;
+					m_retired_tables.fetch_sub(count);
+				}
+
+				if (!m_retired)
+					return;
+
+				// the previous epoch has no readers left, so its counter can be reused by the next one
+				// readers that arrive from now on can only load the current table
+				m_draining = m_retired;
+				m_retired = nullptr;
+				m_epoch.store(epoch + 1);
+			}
+		}
+
+		template<class Match>
+		static bool removeFromList(HandlerTable& table, std::type_index evt_type, Match match)
+		{
+			auto it = table.handlers.find(evt_type);
+			if (it == table.handlers.end())
+				return false;
+
+			auto& handlers = it->second;
+			for (auto handler = handlers.begin(), end = handlers.end(); handler != end; ++handler)
+			{
+				if (match(*handler))
+				{
+					handlers.erase(handler);
+					if (handlers.empty())
+						table.handlers.erase(it);
+
+					return true;
+				}
+			}
+
+			return false;
 		}
 
 		template<class Event, class EventReceiver>
 		void bindEventReceiver(std::shared_ptr<EventReceiver> receiver)
 		{
+			waitForReaders();
 			std::lock_guard<std::mutex> guard(m_mutex);
-			auto handler = std::make_shared<EventHandlerImpl<EventReceiver, Event>>(this, receiver);
-			getEventHandlerList(typeid(Event)).push_back(handler);
+			EventHandlerPtr handler = raz::allocate_shared<EventHandlerImpl<EventReceiver, Event>>(m_memory, this, receiver);
+			update([this, &handler](HandlerTable& table)
+			{
+				auto it = table.handlers.find(typeid(Event));
+				if (it == table.handlers.end())
+					it = table.handlers.emplace(typeid(Event), m_memory).first;
+
+				it->second.push_back(handler);
+				return true;
+			});
 		}
 
 		template<class Event, class EventReceiver>
 		void unbindEventReceiver(EventReceiver* receiver)
 		{
+			waitForReaders();
 			std::lock_guard<std::mutex> guard(m_mutex);
-			auto& handlers = getEventHandlerList(typeid(Event));
-			for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it)
+			update([receiver](HandlerTable& table)
 			{
-				if ((*it)->hasEventReceiver(receiver))
-				{
-					handlers.erase(it);
-					return;
-				}
-			}
+				return removeFromList(table, typeid(Event), [receiver](const EventHandlerPtr& handler) { return handler->hasEventReceiver(receiver); });
+			});
 		}
 
 		void removeEventHandler(std::type_index evt_type, IEventHandler* handler)
 		{
+			waitForReaders();
 			std::lock_guard<std::mutex> guard(m_mutex);
-			auto& handlers = getEventHandlerList(evt_type);
-			for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it)
+			update([evt_type, handler](HandlerTable& table)
 			{
-				if (it->get() == handler)
-				{
-					handlers.erase(it);
-					return;
-				}
-			}
+				return removeFromList(table, evt_type, [handler](const EventHandlerPtr& ptr) { return (ptr.get() == handler); });
+			});
 		}
 	};
 
@@ -234,7 +475,7 @@ namespace raz
 		template<class... Events>
 		void bind(EventDispatcher& dispatcher)
 		{
-			dispatcher.bind<Events...>(shared_from_this());
+			dispatcher.bind<Events...>(this->shared_from_this());
 		}
 
 		template<class... Events>
@@ -29,6 +29,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 #include <tuple>
 #include <type_traits>
 #include "raz/hash.hpp"
+#include "raz/memory.hpp"
 
 namespace raz
 {
@@ -249,23 +250,26 @@ namespace raz
 
 	typedef InputDevice<hash32("Keyboard"), ~0u, 0> Keyboard;
 	typedef InputDevice<hash32("Mouse"), 3, 2> Mouse; // three buttons + an XY bundled channel and a mouse wheel channel
-	template<uint32_t ID> using GamePad = typename InputDevice<ID, 12, 4>;
+	template<uint32_t ID> using GamePad = InputDevice<ID, 12, 4>;
 
 
 	class Action;
 	typedef std::shared_ptr<Action> ActionPtr;
 
+	// actions (and the actions combined from them) are allocated from 'memory' if it's set
 	class Action : public std::enable_shared_from_this<Action>
 	{
 	public:
 		template<class Device>
-		static ActionPtr button(uint32_t button, Input::InputType mask = static_cast<Input::InputType>(Input::ButtonPressed | Input::ButtonHeld))
+		static ActionPtr button(uint32_t button,
+			Input::InputType mask = static_cast<Input::InputType>(Input::ButtonPressed | Input::ButtonHeld),
+			IMemoryPool* memory = nullptr)
 		{
 			class ButtonAction : public Action
 			{
 			public:
-				ButtonAction(uint32_t button, Input::InputType mask) :
-					m_button(button), m_mask(mask)
+				ButtonAction(uint32_t button, Input::InputType mask, IMemoryPool* memory) :
+					Action(memory), m_button(button), m_mask(mask)
 				{
 				}
 
@@ -310,17 +314,17 @@ namespace raz
 				}
 			};
 
-			return std::make_shared<ButtonAction>(button, mask);
+			return raz::allocate_shared<ButtonAction>(memory, button, mask, memory);
 		}
 
 		template<class Device>
-		static ActionPtr channel(uint32_t channel)
+		static ActionPtr channel(uint32_t channel, IMemoryPool* memory = nullptr)
 		{
 			class ChannelAction : public Action
 			{
 			public:
-				ChannelAction(uint32_t channel) :
-					m_channel(channel)
+				ChannelAction(uint32_t channel, IMemoryPool* memory) :
+					Action(memory), m_channel(channel)
 				{
 				}
 
@@ -333,15 +337,16 @@ namespace raz
 				uint32_t m_channel;
 			};
 
-			return std::make_shared<ChannelAction>(channel);
+			return raz::allocate_shared<ChannelAction>(memory, channel, memory);
 		}
 
-		static ActionPtr custom(std::function<bool(const Input&)> fn)
+		static ActionPtr custom(std::function<bool(const Input&)> fn, IMemoryPool* memory = nullptr)
 		{
 			class CustomAction : public Action
 			{
 			public:
-				CustomAction(std::function<bool(const Input&)> fn) : m_fn(fn)
+				CustomAction(std::function<bool(const Input&)> fn, IMemoryPool* memory) :
+					Action(memory), m_fn(fn)
 				{
 				}
 
@@ -354,7 +359,11 @@ namespace raz
 				std::function<bool(const Input&)> m_fn;
 			};
 
-			return std::make_shared<CustomAction>(fn);
+			return raz::allocate_shared<CustomAction>(memory, fn, memory);
+		}
+
+		Action(IMemoryPool* memory = nullptr) : m_memory(memory)
+		{
 		}
 
 		virtual ~Action() = default;
@@ -364,6 +373,14 @@ namespace raz
 		{
 			return shared_from_this();
 		}
+
+		IMemoryPool* getMemoryPool() const
+		{
+			return m_memory;
+		}
+
+	private:
+		IMemoryPool* m_memory;
 	};
 
 	template<class... InputDevices>
@@ -454,7 +471,7 @@ inline raz::ActionPtr operator&&(raz::ActionPtr action1, raz::ActionPtr action2)
 	{
 	public:
 		AndAction(raz::ActionPtr action1, raz::ActionPtr action2) :
-			m_action1(action1), m_action2(action2)
+			raz::Action(action1->getMemoryPool()), m_action1(action1), m_action2(action2)
 		{
 		}
 
@@ -468,7 +485,7 @@ inline raz::ActionPtr operator&&(raz::ActionPtr action1, raz::ActionPtr action2)
 		raz::ActionPtr m_action2;
 	};
 
-	return std::make_shared<AndAction>(action1, action2);
+	return raz::allocate_shared<AndAction>(action1->getMemoryPool(), action1, action2);
 }
 
 inline raz::ActionPtr operator||(raz::ActionPtr action1, raz::ActionPtr action2)
@@ -477,7 +494,7 @@ inline raz::ActionPtr operator||(raz::ActionPtr action1, raz::ActionPtr action2)
 	{
 	public:
 		OrAction(raz::ActionPtr action1, raz::ActionPtr action2) :
-			m_action1(action1), m_action2(action2)
+			raz::Action(action1->getMemoryPool()), m_action1(action1), m_action2(action2)
 		{
 		}
 
@@ -491,7 +508,7 @@ inline raz::ActionPtr operator||(raz::ActionPtr action1, raz::ActionPtr action2)
 		raz::ActionPtr m_action2;
 	};
 
-	return std::make_shared<OrAction>(action1, action2);
+	return raz::allocate_shared<OrAction>(action1->getMemoryPool(), action1, action2);
 }
 
 inline raz::ActionPtr operator!(raz::ActionPtr action)
@@ -500,7 +517,7 @@ inline raz::ActionPtr operator!(raz::ActionPtr action)
 	{
 	public:
 		NotAction(raz::ActionPtr action) :
-			m_action(action)
+			raz::Action(action->getMemoryPool()), m_action(action)
 		{
 		}
 
@@ -513,5 +530,5 @@ inline raz::ActionPtr operator!(raz::ActionPtr action)
 		raz::ActionPtr m_action;
 	};
 
-	return std::make_shared<NotAction>(action);
+	return raz::allocate_shared<NotAction>(action->getMemoryPool(), action);
 }
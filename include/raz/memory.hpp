@@ -21,125 +21,1976 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 
 #pragma once
 
+#ifdef _WIN32
+// the min/max macros would break std::min and std::max in every header including this one
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <thread>
 #include <type_traits>
+#include <vector>
 #include "raz/bitset.hpp"
 
-namespace raz
-{
-	class IMemoryPool
-	{
-	public:
-		virtual ~IMemoryPool() = default;
-		virtual void* allocate(size_t bytes) = 0;
-		virtual void  deallocate(void* ptr, size_t bytes) = 0;
-		virtual size_t getFreeMemory() const = 0;
-		virtual size_t getUsedMemory() const = 0;
+namespace raz
+{
+	template<class T>
+	class Allocator;
+
+	// runs[i] counts the free runs of [2^i, 2^(i+1)) bytes
+	struct FreeRunHistogram
+	{
+		enum : size_t { BUCKETS = 64 };
+
+		uint64_t runs[BUCKETS] = {};
+		uint64_t free_memory = 0;
+		uint64_t largest_run = 0;
+
+		void addRun(size_t bytes)
+		{
+			if (bytes == 0)
+				return;
+
+			size_t bucket = 0;
+			while (bucket < BUCKETS - 1 && (bytes >> (bucket + 1)) > 0)
+				++bucket;
+
+			++runs[bucket];
+			free_memory += bytes;
+			if (bytes > largest_run)
+				largest_run = bytes;
+		}
+
+		// the number of free runs that can surely hold a block of 'bytes'
+		uint64_t countRunsFor(size_t bytes) const
+		{
+			size_t bucket = 0;
+			while (bucket < BUCKETS - 1 && (size_t(1) << bucket) < bytes)
+				++bucket;
+
+			uint64_t count = 0;
+			for (; bucket < BUCKETS; ++bucket)
+				count += runs[bucket];
+			return count;
+		}
+
+		template<class Serializer>
+		void operator()(Serializer& serializer)
+		{
+			for (auto& count : runs)
+				serializer(count);
+
+			serializer(free_memory)(largest_run);
+		}
+	};
+
+	class IMemoryPool
+	{
+	public:
+		virtual ~IMemoryPool() = default;
+		virtual void* allocate(size_t bytes) = 0;
+		virtual void  deallocate(void* ptr, size_t bytes) = 0;
+		virtual size_t getFreeMemory() const = 0;
+		virtual size_t getUsedMemory() const = 0;
+
+		// the largest block that could be allocated right now
+		virtual size_t getLargestFreeBlock() const
+		{
+			return getFreeMemory();
+		}
+
+		// pools that don't keep track of their free runs only report their largest free block
+		virtual FreeRunHistogram getFreeRunHistogram() const
+		{
+			FreeRunHistogram histogram;
+			histogram.addRun(getLargestFreeBlock());
+			histogram.free_memory = getFreeMemory();
+			return histogram;
+		}
+
+		// pools return blocks aligned to alignof(std::max_align_t) unless they override these
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				return allocate(bytes);
+			else
+				return allocateOveraligned(bytes, alignment);
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				deallocate(ptr, bytes);
+			else
+				deallocateOveraligned(ptr, bytes, alignment);
+		}
+
+		template<class T, class... Args>
+		T* create(Args&&... args)
+		{
+			raz::Allocator<T> alloc(this);
+			T* t = std::allocator_traits<raz::Allocator<T>>::allocate(alloc, 1);
+			std::allocator_traits<raz::Allocator<T>>::construct(alloc, t, std::forward<Args>(args)...);
+			return t;
+		}
+
+		template<class T>
+		void destroy(T* t)
+		{
+			raz::Allocator<T> alloc(this);
+			std::allocator_traits<raz::Allocator<T>>::destroy(alloc, t);
+			std::allocator_traits<raz::Allocator<T>>::deallocate(alloc, t, 1);
+		}
+
+	protected:
+		// over-allocates and stores the original pointer right before the aligned block
+		void* allocateOveraligned(size_t bytes, size_t alignment)
+		{
+			char* ptr = static_cast<char*>(allocate(bytes + alignment + sizeof(void*)));
+			const size_t misalignment = reinterpret_cast<uintptr_t>(ptr + sizeof(void*)) % alignment;
+			char* aligned = ptr + sizeof(void*) + (misalignment ? alignment - misalignment : 0);
+			std::memcpy(aligned - sizeof(void*), &ptr, sizeof(void*));
+			return aligned;
+		}
+
+		void deallocateOveraligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			void* original;
+			std::memcpy(&original, static_cast<char*>(ptr) - sizeof(void*), sizeof(void*));
+			deallocate(original, bytes + alignment + sizeof(void*));
+		}
+	};
+
+	template<size_t SIZE, size_t ALIGNMENT = 128, class Mutex = std::mutex>
+	class MemoryPool : public IMemoryPool
+	{
+		static_assert(SIZE % ALIGNMENT == 0, "Incorrect alignment");
+		static_assert((ALIGNMENT & (ALIGNMENT - 1)) == 0, "ALIGNMENT must be a power of two");
+
+	public:
+		MemoryPool() = default;
+		MemoryPool(const MemoryPool&) = delete;
+		~MemoryPool() = default;
+
+		MemoryPool& operator=(const MemoryPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
+			const size_t starting_chunk = m_chunks.findFalseRange(chunks);
+
+			if (starting_chunk == CHUNKS)
+				throw std::bad_alloc();
+
+			m_chunks.setRange(starting_chunk, chunks);
+			m_used_chunks += chunks;
+			return m_memory + (starting_chunk * ALIGNMENT);
+		}
+
+		virtual void deallocate(void* ptr, size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
+			const size_t starting_chunk = (static_cast<char*>(ptr) - m_memory) / ALIGNMENT;
+
+			m_chunks.unsetRange(starting_chunk, chunks);
+			m_used_chunks -= chunks;
+		}
+
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (alignment <= ALIGNMENT)
+				return allocate(bytes);
+			else
+				return allocateOveraligned(bytes, alignment);
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			if (alignment <= ALIGNMENT)
+				deallocate(ptr, bytes);
+			else
+				deallocateOveraligned(ptr, bytes, alignment);
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			return ((CHUNKS - m_used_chunks) * ALIGNMENT);
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			return (m_used_chunks * ALIGNMENT);
+		}
+
+		virtual size_t getLargestFreeBlock() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return (m_chunks.getLongestFalseRange() * ALIGNMENT);
+		}
+
+		virtual FreeRunHistogram getFreeRunHistogram() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			FreeRunHistogram histogram;
+			m_chunks.forEachFalseRange([&histogram](size_t, size_t count) { histogram.addRun(count * ALIGNMENT); });
+			return histogram;
+		}
+
+	private:
+		struct DummyMutex
+		{
+			void lock() {};
+			void unlock() {};
+		};
+
+		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
+
+		static constexpr size_t CHUNKS = SIZE / ALIGNMENT;
+
+		Bitset<CHUNKS> m_chunks;
+		size_t m_used_chunks = 0;
+		mutable Lock m_lock;
+		alignas(ALIGNMENT) char m_memory[SIZE];
+	};
+
+	enum PageMode
+	{
+		DEFAULT_PAGES,
+		TRANSPARENT_HUGE_PAGES, // regular pages, but the OS is advised to back them with huge pages
+		HUGE_PAGES              // explicit huge pages, falls back to transparent huge pages if unavailable
+	};
+
+	template<size_t ALIGNMENT = 128, class Mutex = std::mutex>
+	class DynamicMemoryPool : public IMemoryPool
+	{
+		static_assert((ALIGNMENT & (ALIGNMENT - 1)) == 0, "ALIGNMENT must be a power of two");
+
+	public:
+		// 'growth' is the minimum size of the regions added when the pool runs out of memory (0 means fixed capacity)
+		DynamicMemoryPool(size_t capacity, size_t growth = 0, PageMode page_mode = DEFAULT_PAGES) :
+			DynamicMemoryPool(capacity, growth, page_mode, -1)
+		{
+		}
+
+		DynamicMemoryPool(const DynamicMemoryPool&) = delete;
+
+		~DynamicMemoryPool()
+		{
+			for (auto& region : m_regions)
+				unmapMemory(region.memory, region.size);
+		}
+
+		DynamicMemoryPool& operator=(const DynamicMemoryPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
+
+			for (auto& region : m_regions)
+			{
+				void* ptr = allocateFromRegion(region, chunks);
+				if (ptr)
+					return ptr;
+			}
+
+			if (m_growth == 0 || chunks > (~size_t(0) / ALIGNMENT))
+				throw std::bad_alloc();
+
+			addRegionUnsafe((chunks * ALIGNMENT > m_growth) ? chunks * ALIGNMENT : m_growth);
+			return allocateFromRegion(m_regions.back(), chunks);
+		}
+
+		virtual void deallocate(void* ptr, size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
+
+			for (auto& region : m_regions)
+			{
+				if (ptr >= region.memory && ptr < region.memory + region.size)
+				{
+					const size_t starting_chunk = (static_cast<char*>(ptr) - region.memory) / ALIGNMENT;
+					region.chunks.unsetRange(starting_chunk, chunks);
+					m_used_memory -= chunks * ALIGNMENT;
+					return;
+				}
+			}
+		}
+
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (alignment <= ALIGNMENT)
+				return allocate(bytes);
+			else
+				return allocateOveraligned(bytes, alignment);
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			if (alignment <= ALIGNMENT)
+				deallocate(ptr, bytes);
+			else
+				deallocateOveraligned(ptr, bytes, alignment);
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			return (m_capacity - m_used_memory);
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			return m_used_memory;
+		}
+
+		virtual size_t getLargestFreeBlock() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			size_t largest = 0;
+			for (auto& region : m_regions)
+			{
+				const size_t block = region.chunks.getLongestFalseRange() * ALIGNMENT;
+				if (block > largest)
+					largest = block;
+			}
+			return largest;
+		}
+
+		virtual FreeRunHistogram getFreeRunHistogram() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			FreeRunHistogram histogram;
+			for (auto& region : m_regions)
+				region.chunks.forEachFalseRange([&histogram](size_t, size_t count) { histogram.addRun(count * ALIGNMENT); });
+			return histogram;
+		}
+
+		size_t getCapacity() const
+		{
+			return m_capacity;
+		}
+
+		// the size is rounded up to the page size
+		void addRegion(size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			addRegionUnsafe(bytes);
+		}
+
+	protected:
+		// binds the memory of every region to 'numa_node' (unless it's negative)
+		DynamicMemoryPool(size_t capacity, size_t growth, PageMode page_mode, int numa_node) :
+			m_growth(growth),
+			m_page_mode(page_mode),
+			m_numa_node(numa_node),
+			m_numa_bound(numa_node >= 0),
+			m_capacity(0),
+			m_used_memory(0)
+		{
+			addRegion(capacity);
+		}
+
+		bool isNumaBound() const
+		{
+			return m_numa_bound;
+		}
+
+	private:
+		struct DummyMutex
+		{
+			void lock() {};
+			void unlock() {};
+		};
+
+		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
+
+		struct Region
+		{
+			char* memory;
+			size_t size;
+			DynamicBitset chunks;
+		};
+
+		size_t m_growth;
+		PageMode m_page_mode;
+		int m_numa_node;
+		bool m_numa_bound;
+		mutable Lock m_lock;
+		std::vector<Region> m_regions;
+		size_t m_capacity;
+		size_t m_used_memory;
+
+		void* allocateFromRegion(Region& region, size_t chunks)
+		{
+			const size_t starting_chunk = region.chunks.findFalseRange(chunks);
+			if (starting_chunk == region.chunks.bits())
+				return nullptr;
+
+			region.chunks.setRange(starting_chunk, chunks);
+			m_used_memory += chunks * ALIGNMENT;
+			return region.memory + (starting_chunk * ALIGNMENT);
+		}
+
+		void addRegionUnsafe(size_t bytes)
+		{
+			const size_t page_size = getPageSize(m_page_mode);
+			const size_t size = ((bytes + page_size - 1) / page_size) * page_size;
+
+			Region region;
+			region.memory = static_cast<char*>(mapMemory(size, m_page_mode, m_numa_node, m_numa_bound));
+			region.size = size;
+
+			try
+			{
+				region.chunks = DynamicBitset(size / ALIGNMENT);
+				m_regions.push_back(std::move(region));
+			}
+			catch (...)
+			{
+				unmapMemory(region.memory, size);
+				throw;
+			}
+
+			m_capacity += (size / ALIGNMENT) * ALIGNMENT;
+		}
+
+		static size_t getPageSize(PageMode page_mode)
+		{
+			const size_t huge_page_size = 2 * 1024 * 1024;
+			const size_t page_size = (page_mode == DEFAULT_PAGES) ? 4096 : huge_page_size;
+			return (page_size > ALIGNMENT) ? page_size : ALIGNMENT;
+		}
+
+		static void* mapMemory(size_t size, PageMode page_mode, int numa_node, bool& numa_bound)
+		{
+#ifdef _WIN32
+			void* ptr = nullptr;
+
+			if (page_mode == HUGE_PAGES && GetLargePageMinimum() > 0 && size % GetLargePageMinimum() == 0)
+				ptr = virtualAlloc(size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, numa_node);
+
+			if (!ptr)
+				ptr = virtualAlloc(size, MEM_RESERVE | MEM_COMMIT, numa_node);
+
+			if (!ptr)
+				throw std::bad_alloc();
+
+			return ptr;
+#else
+			void* ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+			if (page_mode == HUGE_PAGES)
+				ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+			if (ptr == MAP_FAILED)
+			{
+				ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (ptr == MAP_FAILED)
+					throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+				if (page_mode != DEFAULT_PAGES)
+					madvise(ptr, size, MADV_HUGEPAGE); // only a hint, failure is fine
+#endif
+			}
+
+			// the policy has to be set before the pages are touched
+			if (numa_node >= 0 && !bindToNumaNode(ptr, size, numa_node))
+				numa_bound = false;
+
+			return ptr;
+#endif
+		}
+
+#ifdef _WIN32
+		static void* virtualAlloc(size_t size, DWORD type, int numa_node)
+		{
+			if (numa_node >= 0)
+				return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, type, PAGE_READWRITE, static_cast<DWORD>(numa_node));
+			else
+				return VirtualAlloc(nullptr, size, type, PAGE_READWRITE);
+		}
+#else
+		static bool bindToNumaNode(void* ptr, size_t size, int numa_node)
+		{
+#if defined(__linux__) && defined(SYS_mbind)
+			// calling the syscall directly, so we don't depend on libnuma
+			const int MPOL_BIND_MODE = 2;
+			const size_t bits_per_word = sizeof(unsigned long) * 8;
+			unsigned long nodemask[16] = {};
+
+			if (static_cast<size_t>(numa_node) >= bits_per_word * 16)
+				return false;
+
+			nodemask[numa_node / bits_per_word] = 1ul << (numa_node % bits_per_word);
+
+			// the kernel reads maxnode - 1 bits of the mask
+			return (syscall(SYS_mbind, ptr, size, MPOL_BIND_MODE, nodemask, bits_per_word * 16 + 1, 0) == 0);
+#else
+			return false;
+#endif
+		}
+#endif
+
+		static void unmapMemory(void* ptr, size_t size)
+		{
+#ifdef _WIN32
+			VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+			munmap(ptr, size);
+#endif
+		}
+	};
+
+	template<size_t ALIGNMENT = 128, class Mutex = std::mutex>
+	class NumaMemoryPool : public DynamicMemoryPool<ALIGNMENT, Mutex>
+	{
+	public:
+		// if the memory can't be bound (no NUMA support, invalid node) the pool still works with the default policy
+		NumaMemoryPool(int numa_node, size_t capacity, size_t growth = 0, PageMode page_mode = DEFAULT_PAGES) :
+			DynamicMemoryPool<ALIGNMENT, Mutex>(capacity, growth, page_mode, numa_node),
+			m_numa_node(numa_node)
+		{
+		}
+
+		int getNumaNode() const
+		{
+			return m_numa_node;
+		}
+
+		bool isBound() const
+		{
+			return this->isNumaBound();
+		}
+
+	private:
+		int m_numa_node;
+	};
+
+	template<size_t SLAB_SIZE = 64 * 1024, size_t MAX_BLOCK_SIZE = 1024, class Mutex = std::mutex>
+	class SlabPool : public IMemoryPool
+	{
+		static_assert((MAX_BLOCK_SIZE & (MAX_BLOCK_SIZE - 1)) == 0, "MAX_BLOCK_SIZE must be a power of two");
+		static_assert(MAX_BLOCK_SIZE >= sizeof(void*), "MAX_BLOCK_SIZE is too small");
+
+	public:
+		// slabs and blocks above MAX_BLOCK_SIZE come from 'upstream' (or the global heap)
+		SlabPool(IMemoryPool* upstream = nullptr) :
+			m_upstream(upstream),
+			m_slabs(nullptr),
+			m_free_memory(0),
+			m_used_memory(0)
+		{
+			for (auto& head : m_free_lists)
+				head = nullptr;
+		}
+
+		SlabPool(const SlabPool&) = delete;
+
+		~SlabPool()
+		{
+			while (m_slabs)
+			{
+				Slab* next = m_slabs->next;
+				upstreamDeallocate(m_slabs, SLAB_SIZE);
+				m_slabs = next;
+			}
+		}
+
+		SlabPool& operator=(const SlabPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			if (bytes > MAX_BLOCK_SIZE)
+			{
+				void* ptr = upstreamAllocate(bytes);
+				std::lock_guard<Lock> guard(m_lock);
+				m_used_memory += bytes;
+				return ptr;
+			}
+
+			const size_t size_class = getSizeClass(bytes);
+			const size_t block_size = getBlockSize(size_class);
+
+			std::lock_guard<Lock> guard(m_lock);
+
+			if (!m_free_lists[size_class])
+				addSlab(size_class);
+
+			FreeBlock* block = m_free_lists[size_class];
+			m_free_lists[size_class] = block->next;
+			m_free_memory -= block_size;
+			m_used_memory += block_size;
+			return block;
+		}
+
+		virtual void deallocate(void* ptr, size_t bytes)
+		{
+			if (bytes > MAX_BLOCK_SIZE)
+			{
+				upstreamDeallocate(ptr, bytes);
+				std::lock_guard<Lock> guard(m_lock);
+				m_used_memory -= bytes;
+				return;
+			}
+
+			const size_t size_class = getSizeClass(bytes);
+			const size_t block_size = getBlockSize(size_class);
+
+			std::lock_guard<Lock> guard(m_lock);
+
+			FreeBlock* block = static_cast<FreeBlock*>(ptr);
+			block->next = m_free_lists[size_class];
+			m_free_lists[size_class] = block;
+			m_free_memory += block_size;
+			m_used_memory -= block_size;
+		}
+
+		// blocks are aligned to their size (up to alignof(std::max_align_t)), so small alignments only need a large enough block
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				return allocate((bytes < alignment) ? alignment : bytes);
+			else
+				return allocateOveraligned(bytes, alignment);
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				deallocate(ptr, (bytes < alignment) ? alignment : bytes);
+			else
+				deallocateOveraligned(ptr, bytes, alignment);
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			return m_free_memory;
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			return m_used_memory;
+		}
+
+		virtual size_t getLargestFreeBlock() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			for (size_t size_class = CLASS_COUNT; size_class > 0; --size_class)
+			{
+				if (m_free_lists[size_class - 1])
+					return getBlockSize(size_class - 1);
+			}
+			return 0;
+		}
+
+	private:
+		struct DummyMutex
+		{
+			void lock() {};
+			void unlock() {};
+		};
+
+		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
+
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		struct Slab
+		{
+			Slab* next;
+		};
+
+		static constexpr size_t MIN_BLOCK_SIZE = sizeof(void*);
+		static constexpr size_t SLAB_HEADER_SIZE = ((sizeof(Slab) - 1) / alignof(std::max_align_t) + 1) * alignof(std::max_align_t);
+		static_assert(SLAB_SIZE >= SLAB_HEADER_SIZE + MAX_BLOCK_SIZE, "SLAB_SIZE is too small");
+
+		static constexpr size_t getClassCount(size_t block_size = MIN_BLOCK_SIZE)
+		{
+			return (block_size >= MAX_BLOCK_SIZE) ? 1 : 1 + getClassCount(block_size * 2);
+		}
+
+		static constexpr size_t CLASS_COUNT = getClassCount();
+
+		IMemoryPool* m_upstream;
+		mutable Lock m_lock;
+		Slab* m_slabs;
+		FreeBlock* m_free_lists[CLASS_COUNT];
+		size_t m_free_memory;
+		size_t m_used_memory;
+
+		static size_t getSizeClass(size_t bytes)
+		{
+			size_t size_class = 0;
+			size_t block_size = MIN_BLOCK_SIZE;
+			while (block_size < bytes)
+			{
+				block_size *= 2;
+				++size_class;
+			}
+			return size_class;
+		}
+
+		static size_t getBlockSize(size_t size_class)
+		{
+			return (MIN_BLOCK_SIZE << size_class);
+		}
+
+		void addSlab(size_t size_class)
+		{
+			Slab* slab = static_cast<Slab*>(upstreamAllocate(SLAB_SIZE));
+			slab->next = m_slabs;
+			m_slabs = slab;
+
+			// carve the slab into blocks and push them to the free list in address order
+			const size_t block_size = getBlockSize(size_class);
+			const size_t blocks = (SLAB_SIZE - SLAB_HEADER_SIZE) / block_size;
+			char* memory = reinterpret_cast<char*>(slab) + SLAB_HEADER_SIZE;
+
+			for (size_t i = blocks; i > 0; --i)
+			{
+				FreeBlock* block = reinterpret_cast<FreeBlock*>(memory + (i - 1) * block_size);
+				block->next = m_free_lists[size_class];
+				m_free_lists[size_class] = block;
+			}
+
+			m_free_memory += blocks * block_size;
+		}
+
+		void* upstreamAllocate(size_t bytes)
+		{
+			if (m_upstream)
+				return m_upstream->allocate(bytes);
+			else
+				return ::operator new(bytes);
+		}
+
+		void upstreamDeallocate(void* ptr, size_t bytes)
+		{
+			if (m_upstream)
+				m_upstream->deallocate(ptr, bytes);
+			else
+				::operator delete(ptr);
+		}
+	};
+
+	template<size_t MAGAZINE_SIZE = 32, size_t MAX_BLOCK_SIZE = 1024>
+	class ThreadCachedPool : public IMemoryPool
+	{
+		static_assert(MAGAZINE_SIZE >= 2, "MAGAZINE_SIZE is too small");
+		static_assert((MAX_BLOCK_SIZE & (MAX_BLOCK_SIZE - 1)) == 0, "MAX_BLOCK_SIZE must be a power of two");
+
+	public:
+		// please note that 'pool' must be thread-safe, but it's only accessed when a magazine is refilled or flushed
+		ThreadCachedPool(IMemoryPool* pool = nullptr) :
+			m_shared(std::make_shared<Shared>(pool))
+		{
+		}
+
+		ThreadCachedPool(const ThreadCachedPool&) = delete;
+
+		~ThreadCachedPool()
+		{
+			std::lock_guard<std::mutex> guard(m_shared->mutex);
+			for (Cache* cache : m_shared->caches)
+			{
+				CacheLock lock(*cache);
+				cache->flush();
+			}
+			m_shared->caches.clear();
+			m_shared->alive = false;
+		}
+
+		ThreadCachedPool& operator=(const ThreadCachedPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			Cache& cache = getCache();
+			CacheLock lock(cache);
+
+			if (bytes > MAX_BLOCK_SIZE)
+			{
+				void* ptr = cache.upstreamAllocate(bytes);
+				cache.used_memory.store(cache.used_memory.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+				return ptr;
+			}
+
+			const size_t size_class = getSizeClass(bytes);
+			Magazine& magazine = cache.magazines[size_class];
+
+			if (magazine.count == 0)
+				cache.refill(size_class);
+
+			return cache.pop(size_class);
+		}
+
+		virtual void deallocate(void* ptr, size_t bytes)
+		{
+			Cache& cache = getCache();
+			CacheLock lock(cache);
+
+			if (bytes > MAX_BLOCK_SIZE)
+			{
+				cache.upstreamDeallocate(ptr, bytes);
+				cache.used_memory.store(cache.used_memory.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+				return;
+			}
+
+			const size_t size_class = getSizeClass(bytes);
+			Magazine& magazine = cache.magazines[size_class];
+
+			if (magazine.count == MAGAZINE_SIZE)
+				cache.flush(size_class, MAGAZINE_SIZE / 2);
+
+			cache.push(size_class, ptr);
+		}
+
+		// blocks are handed out in power-of-two sizes, so small alignments only need a large enough block
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				return allocate((bytes < alignment) ? alignment : bytes);
+			else
+				return allocateOveraligned(bytes, alignment);
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			if (alignment <= alignof(std::max_align_t))
+				deallocate(ptr, (bytes < alignment) ? alignment : bytes);
+			else
+				deallocateOveraligned(ptr, bytes, alignment);
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			std::lock_guard<std::mutex> guard(m_shared->mutex);
+			size_t cached_memory = m_shared->cached_memory;
+			for (Cache* cache : m_shared->caches)
+			{
+				cached_memory += cache->cached_memory.load(std::memory_order_relaxed);
+			}
+			return (m_shared->pool ? m_shared->pool->getFreeMemory() : 0) + cached_memory;
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			std::lock_guard<std::mutex> guard(m_shared->mutex);
+			size_t used_memory = m_shared->used_memory;
+			for (Cache* cache : m_shared->caches)
+			{
+				used_memory += cache->used_memory.load(std::memory_order_relaxed);
+			}
+			return used_memory;
+		}
+
+	private:
+		static constexpr size_t MIN_BLOCK_SIZE = sizeof(void*);
+
+		static constexpr size_t getClassCount(size_t block_size = MIN_BLOCK_SIZE)
+		{
+			return (block_size >= MAX_BLOCK_SIZE) ? 1 : 1 + getClassCount(block_size * 2);
+		}
+
+		static constexpr size_t CLASS_COUNT = getClassCount();
+
+		struct Cache;
+
+		struct Shared
+		{
+			Shared(IMemoryPool* pool) : pool(pool), alive(true), cached_memory(0), used_memory(0)
+			{
+			}
+
+			IMemoryPool* pool;
+			std::atomic<bool> alive;
+			std::mutex mutex; // guards the list of caches and the counters of already retired caches
+			std::vector<Cache*> caches;
+			size_t cached_memory;
+			size_t used_memory;
+		};
+
+		struct Magazine
+		{
+			void* blocks[MAGAZINE_SIZE];
+			size_t count = 0;
+		};
+
+		struct Cache
+		{
+			Cache(std::shared_ptr<Shared> shared) : shared(shared), busy(false), cached_memory(0), used_memory(0)
+			{
+			}
+
+			std::shared_ptr<Shared> shared;
+			std::atomic<bool> busy; // held by the owner thread while using the magazines, and by the pool's destructor while flushing them
+			Magazine magazines[CLASS_COUNT];
+			std::atomic<size_t> cached_memory; // only written by the owner thread
+			std::atomic<size_t> used_memory;   // only written by the owner thread (wraps around if other threads free the memory)
+
+			void* pop(size_t size_class)
+			{
+				const size_t block_size = getBlockSize(size_class);
+				cached_memory.store(cached_memory.load(std::memory_order_relaxed) - block_size, std::memory_order_relaxed);
+				used_memory.store(used_memory.load(std::memory_order_relaxed) + block_size, std::memory_order_relaxed);
+
+				Magazine& magazine = magazines[size_class];
+				return magazine.blocks[--magazine.count];
+			}
+
+			void push(size_t size_class, void* ptr)
+			{
+				const size_t block_size = getBlockSize(size_class);
+				cached_memory.store(cached_memory.load(std::memory_order_relaxed) + block_size, std::memory_order_relaxed);
+				used_memory.store(used_memory.load(std::memory_order_relaxed) - block_size, std::memory_order_relaxed);
+
+				Magazine& magazine = magazines[size_class];
+				magazine.blocks[magazine.count++] = ptr;
+			}
+
+			void refill(size_t size_class)
+			{
+				const size_t block_size = getBlockSize(size_class);
+				Magazine& magazine = magazines[size_class];
+
+				while (magazine.count < MAGAZINE_SIZE / 2)
+				{
+					magazine.blocks[magazine.count++] = upstreamAllocate(block_size);
+					cached_memory.store(cached_memory.load(std::memory_order_relaxed) + block_size, std::memory_order_relaxed);
+				}
+			}
+
+			void flush(size_t size_class, size_t blocks)
+			{
+				const size_t block_size = getBlockSize(size_class);
+				Magazine& magazine = magazines[size_class];
+
+				for (; blocks > 0 && magazine.count > 0; --blocks)
+				{
+					upstreamDeallocate(magazine.blocks[--magazine.count], block_size);
+					cached_memory.store(cached_memory.load(std::memory_order_relaxed) - block_size, std::memory_order_relaxed);
+				}
+			}
+
+			void flush()
+			{
+				for (size_t i = 0; i < CLASS_COUNT; ++i)
+					flush(i, MAGAZINE_SIZE);
+			}
+
+			void* upstreamAllocate(size_t bytes)
+			{
+				if (shared->pool)
+					return shared->pool->allocate(bytes);
+				else
+					return ::operator new(bytes);
+			}
+
+			void upstreamDeallocate(void* ptr, size_t bytes)
+			{
+				if (shared->pool)
+					shared->pool->deallocate(ptr, bytes);
+				else
+					::operator delete(ptr);
+			}
+		};
+
+		// the owner thread never has to wait for it, unless the pool is being destroyed
+		class CacheLock
+		{
+		public:
+			CacheLock(Cache& cache) : m_cache(cache)
+			{
+				while (m_cache.busy.exchange(true, std::memory_order_acquire))
+					std::this_thread::yield();
+			}
+
+			CacheLock(const CacheLock&) = delete;
+
+			~CacheLock()
+			{
+				m_cache.busy.store(false, std::memory_order_release);
+			}
+
+			CacheLock& operator=(const CacheLock&) = delete;
+
+		private:
+			Cache& m_cache;
+		};
+
+		struct LocalCaches
+		{
+			std::vector<std::unique_ptr<Cache>> caches;
+			Cache* last = nullptr;
+
+			~LocalCaches()
+			{
+				// return the blocks of exiting threads to the pools that are still alive
+				for (auto& cache : caches)
+				{
+					Shared& shared = *cache->shared;
+					std::lock_guard<std::mutex> guard(shared.mutex);
+
+					if (shared.alive)
+					{
+						cache->flush();
+						shared.used_memory += cache->used_memory;
+						shared.caches.erase(std::find(shared.caches.begin(), shared.caches.end(), cache.get()));
+					}
+				}
+			}
+		};
+
+		std::shared_ptr<Shared> m_shared;
+
+		static size_t getSizeClass(size_t bytes)
+		{
+			size_t size_class = 0;
+			size_t block_size = MIN_BLOCK_SIZE;
+			while (block_size < bytes)
+			{
+				block_size *= 2;
+				++size_class;
+			}
+			return size_class;
+		}
+
+		static size_t getBlockSize(size_t size_class)
+		{
+			return (MIN_BLOCK_SIZE << size_class);
+		}
+
+		static LocalCaches& getLocalCaches()
+		{
+			thread_local LocalCaches local_caches;
+			return local_caches;
+		}
+
+		Cache& getCache()
+		{
+			LocalCaches& local = getLocalCaches();
+
+			if (local.last && local.last->shared == m_shared)
+				return *local.last;
+
+			// drop the caches of destroyed pools while we are at it
+			auto it = local.caches.begin();
+			while (it != local.caches.end())
+			{
+				if ((*it)->shared == m_shared)
+				{
+					local.last = it->get();
+					return *local.last;
+				}
+				else if (!(*it)->shared->alive)
+				{
+					it = local.caches.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+
+			local.caches.emplace_back(new Cache(m_shared));
+			local.last = local.caches.back().get();
+
+			std::lock_guard<std::mutex> guard(m_shared->mutex);
+			m_shared->caches.push_back(local.last);
+			return *local.last;
+		}
+	};
+
+	template<size_t BLOCK_SIZE = 64 * 1024, class Mutex = std::mutex>
+	class ArenaPool : public IMemoryPool
+	{
+	public:
+		// blocks come from 'upstream' (or the global heap) and are kept until release() or destruction
+		ArenaPool(IMemoryPool* upstream = nullptr) :
+			m_upstream(upstream),
+			m_first(nullptr),
+			m_current(nullptr),
+			m_offset(0),
+			m_capacity(0),
+			m_consumed(0)
+		{
+		}
+
+		ArenaPool(const ArenaPool&) = delete;
+
+		~ArenaPool()
+		{
+			release();
+		}
+
+		ArenaPool& operator=(const ArenaPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return allocateUnsafe(bytes, ALIGNMENT);
+		}
+
+		virtual void deallocate(void*, size_t)
+		{
+			// memory is only reclaimed by reset() or release()
+		}
+
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return allocateUnsafe(bytes, (alignment > ALIGNMENT) ? alignment : ALIGNMENT);
+		}
+
+		virtual void deallocateAligned(void*, size_t, size_t)
+		{
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			return (m_capacity - m_consumed);
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			return m_consumed;
+		}
+
+		// invalidates every allocation, but keeps the blocks for reuse
+		void reset()
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			m_current = m_first;
+			m_offset = 0;
+			m_consumed = 0;
+		}
+
+		// invalidates every allocation and returns the blocks to the upstream pool
+		void release()
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			while (m_first)
+			{
+				Block* next = m_first->next;
+				upstreamDeallocate(m_first, HEADER_SIZE + m_first->size);
+				m_first = next;
+			}
+
+			m_current = nullptr;
+			m_offset = 0;
+			m_capacity = 0;
+			m_consumed = 0;
+		}
+
+	private:
+		struct DummyMutex
+		{
+			void lock() {};
+			void unlock() {};
+		};
+
+		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
+
+		struct Block
+		{
+			Block* next;
+			size_t size;
+		};
+
+		static constexpr size_t ALIGNMENT = alignof(std::max_align_t);
+		static constexpr size_t HEADER_SIZE = ((sizeof(Block) - 1) / ALIGNMENT + 1) * ALIGNMENT;
+		static_assert(BLOCK_SIZE > HEADER_SIZE, "BLOCK_SIZE is too small");
+
+		IMemoryPool* m_upstream;
+		Lock m_lock;
+		Block* m_first;
+		Block* m_current;
+		size_t m_offset;
+		size_t m_capacity;
+		size_t m_consumed;
+
+		void* allocateUnsafe(size_t bytes, size_t alignment)
+		{
+			bytes = ((bytes + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT;
+
+			size_t padding = m_current ? getPadding(alignment) : 0;
+
+			if (!m_current || m_current->size - m_offset < padding + bytes)
+			{
+				// block payloads are ALIGNMENT aligned, so this is the worst case padding
+				nextBlock(bytes + alignment - ALIGNMENT);
+				padding = getPadding(alignment);
+			}
+
+			m_offset += padding;
+			void* ptr = reinterpret_cast<char*>(m_current) + HEADER_SIZE + m_offset;
+			m_offset += bytes;
+			m_consumed += padding + bytes;
+			return ptr;
+		}
+
+		size_t getPadding(size_t alignment) const
+		{
+			const uintptr_t address = reinterpret_cast<uintptr_t>(m_current) + HEADER_SIZE + m_offset;
+			const size_t misalignment = address % alignment;
+			return misalignment ? alignment - misalignment : 0;
+		}
+
+		void nextBlock(size_t bytes)
+		{
+			// the rest of the current block is wasted until the next reset
+			if (m_current)
+				m_consumed += m_current->size - m_offset;
+
+			Block* block = nullptr;
+
+			// blocks retained by a previous reset are reused if they are large enough
+			for (Block* prev = m_current; prev && prev->next; prev = prev->next)
+			{
+				if (prev->next->size >= bytes)
+				{
+					block = prev->next;
+					prev->next = block->next;
+					block->next = m_current->next;
+					break;
+				}
+			}
+
+			if (!block)
+			{
+				const size_t size = (bytes > BLOCK_SIZE - HEADER_SIZE) ? bytes : BLOCK_SIZE - HEADER_SIZE;
+				block = static_cast<Block*>(upstreamAllocate(HEADER_SIZE + size));
+				block->size = size;
+				block->next = m_current ? m_current->next : nullptr;
+				m_capacity += size;
+			}
+
+			if (m_current)
+				m_current->next = block;
+			else
+				m_first = block;
+
+			m_current = block;
+			m_offset = 0;
+		}
+
+		void* upstreamAllocate(size_t bytes)
+		{
+			if (m_upstream)
+				return m_upstream->allocate(bytes);
+			else
+				return ::operator new(bytes);
+		}
+
+		void upstreamDeallocate(void* ptr, size_t bytes)
+		{
+			if (m_upstream)
+				m_upstream->deallocate(ptr, bytes);
+			else
+				::operator delete(ptr);
+		}
+	};
+
+	template<class T, size_t N>
+	class ObjectPool : public IMemoryPool
+	{
+		static_assert(N > 0 && N < 0xFFFFFFFF, "Incorrect pool size");
+
+	public:
+		class Deleter
+		{
+		public:
+			Deleter(ObjectPool* pool = nullptr) : m_pool(pool)
+			{
+			}
+
+			void operator()(T* t) const
+			{
+				m_pool->destroy(t);
+			}
+
+		private:
+			ObjectPool* m_pool;
+		};
+
+		typedef std::unique_ptr<T, Deleter> Handle;
+
+		ObjectPool() :
+			m_head(0),
+			m_used_slots(0)
+		{
+			for (size_t i = 0; i < N; ++i)
+				m_next[i].store(static_cast<uint32_t>(i + 1), std::memory_order_relaxed);
+
+			m_next[N - 1].store(EMPTY, std::memory_order_relaxed);
+		}
+
+		ObjectPool(const ObjectPool&) = delete;
+
+		ObjectPool& operator=(const ObjectPool&) = delete;
+
+		// the object goes back to the pool when the handle is destroyed
+		template<class... Args>
+		Handle acquire(Args&&... args)
+		{
+			return Handle(create<T>(std::forward<Args>(args)...), Deleter(this));
+		}
+
+		virtual void* allocate(size_t bytes)
+		{
+			return allocateAligned(bytes, alignof(T));
+		}
+
+		virtual void deallocate(void* ptr, size_t)
+		{
+			const size_t slot = static_cast<Slot*>(ptr) - m_slots;
+			push(static_cast<uint32_t>(slot));
+		}
+
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			if (bytes > sizeof(Slot) || alignment > alignof(Slot))
+				throw std::bad_alloc();
+
+			const uint32_t slot = pop();
+			if (slot == EMPTY)
+				throw std::bad_alloc();
+
+			return &m_slots[slot];
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t)
+		{
+			deallocate(ptr, bytes);
+		}
+
+		virtual size_t getFreeMemory() const
+		{
+			return (N - m_used_slots.load(std::memory_order_relaxed)) * sizeof(Slot);
+		}
+
+		virtual size_t getUsedMemory() const
+		{
+			return m_used_slots.load(std::memory_order_relaxed) * sizeof(Slot);
+		}
+
+		virtual size_t getLargestFreeBlock() const
+		{
+			return (m_used_slots.load(std::memory_order_relaxed) < N) ? sizeof(Slot) : 0;
+		}
+
+	private:
+		struct alignas(T) Slot
+		{
+			char data[sizeof(T)];
+		};
+
+		static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+		// the head of the free list is the index of the first free slot in the lower 32 bits,
+		// and a counter in the upper 32 bits that is incremented on every change to avoid the ABA problem
+		std::atomic<uint64_t> m_head;
+		std::atomic<uint32_t> m_next[N];
+		std::atomic<size_t> m_used_slots;
+		Slot m_slots[N];
+
+		uint32_t pop()
+		{
+			uint64_t head = m_head.load(std::memory_order_acquire);
+
+			for (;;)
+			{
+				const uint32_t slot = static_cast<uint32_t>(head);
+				if (slot == EMPTY)
+					return EMPTY;
+
+				const uint64_t next = m_next[slot].load(std::memory_order_relaxed) | ((head >> 32) + 1) << 32;
+				if (m_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+				{
+					m_used_slots.fetch_add(1, std::memory_order_relaxed);
+					return slot;
+				}
+			}
+		}
+
+		void push(uint32_t slot)
+		{
+			uint64_t head = m_head.load(std::memory_order_relaxed);
+			uint64_t next;
+
+			do
+			{
+				m_next[slot].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+				next = slot | ((head >> 32) + 1) << 32;
+			} while (!m_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+
+			m_used_slots.fetch_sub(1, std::memory_order_relaxed);
+		}
+	};
+
+	class IRelocatablePool
+	{
+	public:
+		virtual ~IRelocatablePool() = default;
+		virtual void* resolve(uint32_t handle) const = 0;
+		virtual size_t getSize(uint32_t handle) const = 0;
+		virtual void release(uint32_t handle) = 0;
+	};
+
+	// blocks are reached through a table, so the pool is free to move them around
+	// pointers returned by get() are only valid until the pool is compacted
+	template<class T>
+	class Handle
+	{
+	public:
+		Handle() :
+			m_pool(nullptr), m_index(0)
+		{
+		}
+
+		Handle(IRelocatablePool* pool, uint32_t index) :
+			m_pool(pool), m_index(index)
+		{
+		}
+
+		Handle(const Handle&) = delete;
+
+		Handle(Handle&& other) :
+			m_pool(other.m_pool), m_index(other.m_index)
+		{
+			other.m_pool = nullptr;
+		}
+
+		~Handle()
+		{
+			reset();
+		}
+
+		Handle& operator=(const Handle&) = delete;
+
+		Handle& operator=(Handle&& other)
+		{
+			if (this != &other)
+			{
+				reset();
+				m_pool = other.m_pool;
+				m_index = other.m_index;
+				other.m_pool = nullptr;
+			}
+			return *this;
+		}
+
+		T* get() const
+		{
+			return (m_pool ? static_cast<T*>(m_pool->resolve(m_index)) : nullptr);
+		}
+
+		T* operator->() const
+		{
+			return get();
+		}
 
-		template<class T, class... Args>
-		T* create(Args&&... args)
+		T& operator*() const
 		{
-			raz::Allocator<T> alloc(this);
-			T* t = std::allocator_traits<raz::Allocator<T>>::allocate(alloc, 1);
-			std::allocator_traits<raz::Allocator<T>>::construct(alloc, t, std::forward<Args>(args)...);
-			return t;
+			return *get();
 		}
 
-		template<class T>
-		void destroy(T* t)
+		explicit operator bool() const
 		{
-			raz::Allocator<T> alloc(this);
-			std::allocator_traits<raz::Allocator<T>>::destroy(alloc, t);
-			std::allocator_traits<raz::Allocator<T>>::deallocate(alloc, t, 1);
+			return (m_pool != nullptr);
+		}
+
+		// size of the block in bytes
+		size_t size() const
+		{
+			return (m_pool ? m_pool->getSize(m_index) : 0);
+		}
+
+		void reset()
+		{
+			if (m_pool)
+			{
+				m_pool->release(m_index);
+				m_pool = nullptr;
+			}
 		}
+
+	private:
+		IRelocatablePool* m_pool;
+		uint32_t m_index;
 	};
 
+	// the Mutex only protects the pool's bookkeeping, blocks must not be in use while compact() runs
 	template<size_t SIZE, size_t ALIGNMENT = 128, class Mutex = std::mutex>
-	class MemoryPool : public IMemoryPool
+	class RelocatablePool : public IRelocatablePool
 	{
 		static_assert(SIZE % ALIGNMENT == 0, "Incorrect alignment");
+		static_assert((ALIGNMENT & (ALIGNMENT - 1)) == 0, "ALIGNMENT must be a power of two");
 
 	public:
-		MemoryPool() = default;
-		MemoryPool(const MemoryPool&) = delete;
-		~MemoryPool() = default;
+		RelocatablePool() = default;
+		RelocatablePool(const RelocatablePool&) = delete;
 
-		MemoryPool& operator=(const MemoryPool&) = delete;
+		~RelocatablePool()
+		{
+			for (auto& entry : m_entries)
+			{
+				if (entry.chunks && entry.destroy)
+					entry.destroy(m_memory + entry.chunk * ALIGNMENT);
+			}
+		}
 
-		virtual void* allocate(size_t bytes)
+		RelocatablePool& operator=(const RelocatablePool&) = delete;
+
+		template<class T, class... Args>
+		Handle<T> create(Args&&... args)
+		{
+			static_assert(alignof(T) <= ALIGNMENT, "Incorrect alignment");
+			static_assert(std::is_move_constructible<T>::value, "T must be move constructible");
+
+			const uint32_t index = allocateEntry(sizeof(T),
+				std::is_trivially_copyable<T>::value ? nullptr : &relocate<T>,
+				std::is_trivially_destructible<T>::value ? nullptr : &destroy<T>);
+
+			try
+			{
+				new (resolve(index)) T(std::forward<Args>(args)...);
+			}
+			catch (...)
+			{
+				std::lock_guard<Lock> guard(m_lock);
+				freeEntry(index);
+				throw;
+			}
+
+			return Handle<T>(this, index);
+		}
+
+		// uninitialized buffer of 'bytes'
+		Handle<char> allocate(size_t bytes)
+		{
+			return Handle<char>(this, allocateEntry(bytes, nullptr, nullptr));
+		}
+
+		// slides every live block towards the beginning of the pool and returns the number of bytes moved
+		size_t compact()
 		{
 			std::lock_guard<Lock> guard(m_lock);
 
-			auto available = m_chunks.falsebits();
-			auto begin_iter = available.begin();
-			auto end_iter = available.end();
+			std::vector<uint32_t> live;
+			for (uint32_t i = 0; i < static_cast<uint32_t>(m_entries.size()); ++i)
+			{
+				if (m_entries[i].chunks)
+					live.push_back(i);
+			}
 
-			if (begin_iter == end_iter)
-				throw std::bad_alloc();
+			std::sort(live.begin(), live.end(),
+				[this](uint32_t a, uint32_t b) { return (m_entries[a].chunk < m_entries[b].chunk); });
 
-			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
-			size_t current_chunk_pos = *begin_iter;
-			size_t current_chunk_size = 0;
+			size_t moved = 0;
+			size_t next_chunk = 0;
 
-			for (auto iter = begin_iter; iter != end_iter; ++iter)
+			for (uint32_t index : live)
 			{
-				if (*iter == current_chunk_pos + current_chunk_size)
-				{
-					++current_chunk_size;
-					if (current_chunk_size == chunks)
-					{
-						for (size_t i = current_chunk_pos; i < current_chunk_pos + current_chunk_size; ++i)
-						{
-							m_chunks.set(i);
-						}
-						return m_memory + (current_chunk_pos * ALIGNMENT);
-					}
-				}
-				else
+				Entry& entry = m_entries[index];
+
+				if (entry.chunk != next_chunk)
 				{
-					current_chunk_pos = *iter;
-					current_chunk_size = 1;
+					char* src = m_memory + entry.chunk * ALIGNMENT;
+					char* dst = m_memory + next_chunk * ALIGNMENT;
+
+					if (entry.relocate)
+						entry.relocate(dst, src);
+					else
+						std::memmove(dst, src, entry.bytes);
+
+					entry.chunk = next_chunk;
+					moved += entry.bytes;
 				}
+
+				next_chunk += entry.chunks;
 			}
 
-			throw std::bad_alloc();
+			m_chunks.reset();
+			m_chunks.setRange(0, next_chunk);
+			return moved;
 		}
 
-		virtual void deallocate(void* ptr, size_t bytes)
+		virtual void* resolve(uint32_t handle) const
 		{
 			std::lock_guard<Lock> guard(m_lock);
+			return const_cast<char*>(m_memory) + m_entries[handle].chunk * ALIGNMENT;
+		}
 
-			const size_t chunks = ((bytes - 1) / ALIGNMENT) + 1;
-			const size_t starting_chunk = (static_cast<char*>(ptr) - m_memory) / ALIGNMENT;
+		virtual size_t getSize(uint32_t handle) const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return m_entries[handle].bytes;
+		}
+
+		virtual void release(uint32_t handle)
+		{
+			void(*destructor)(void*);
+			void* ptr;
+
+			{
+				std::lock_guard<Lock> guard(m_lock);
+				destructor = m_entries[handle].destroy;
+				ptr = m_memory + m_entries[handle].chunk * ALIGNMENT;
+			}
+
+			// the destructor might release other handles
+			if (destructor)
+				destructor(ptr);
+
+			std::lock_guard<Lock> guard(m_lock);
+			freeEntry(handle);
+		}
+
+		size_t getFreeMemory() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return ((CHUNKS - m_used_chunks) * ALIGNMENT);
+		}
+
+		size_t getUsedMemory() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return (m_used_chunks * ALIGNMENT);
+		}
+
+		size_t getLargestFreeBlock() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+			return (m_chunks.getLongestFalseRange() * ALIGNMENT);
+		}
+
+		FreeRunHistogram getFreeRunHistogram() const
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			FreeRunHistogram histogram;
+			m_chunks.forEachFalseRange([&histogram](size_t, size_t count) { histogram.addRun(count * ALIGNMENT); });
+			return histogram;
+		}
+
+	private:
+		struct DummyMutex
+		{
+			void lock() {};
+			void unlock() {};
+		};
+
+		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
+
+		struct Entry
+		{
+			size_t chunk;
+			size_t chunks; // 0 if the entry is unused
+			size_t bytes;
+			void(*relocate)(void* dst, void* src); // nullptr means the block can be moved by memmove
+			void(*destroy)(void*);
+		};
+
+		static constexpr size_t CHUNKS = SIZE / ALIGNMENT;
+
+		Bitset<CHUNKS> m_chunks;
+		size_t m_used_chunks = 0;
+		std::vector<Entry> m_entries;
+		std::vector<uint32_t> m_free_entries;
+		mutable Lock m_lock;
+		alignas(ALIGNMENT) char m_memory[SIZE];
+
+		uint32_t allocateEntry(size_t bytes, void(*relocate)(void*, void*), void(*destroy)(void*))
+		{
+			std::lock_guard<Lock> guard(m_lock);
+
+			const size_t chunks = (bytes > 0) ? ((bytes - 1) / ALIGNMENT) + 1 : 1;
+			const size_t starting_chunk = m_chunks.findFalseRange(chunks);
+
+			if (starting_chunk == CHUNKS)
+				throw std::bad_alloc();
+
+			uint32_t index;
+			if (m_free_entries.empty())
+			{
+				index = static_cast<uint32_t>(m_entries.size());
+				m_entries.push_back(Entry());
+			}
+			else
+			{
+				index = m_free_entries.back();
+				m_free_entries.pop_back();
+			}
+
+			m_entries[index] = Entry{ starting_chunk, chunks, bytes, relocate, destroy };
+			m_chunks.setRange(starting_chunk, chunks);
+			m_used_chunks += chunks;
+			return index;
+		}
+
+		void freeEntry(uint32_t index)
+		{
+			Entry& entry = m_entries[index];
+			m_chunks.unsetRange(entry.chunk, entry.chunks);
+			m_used_chunks -= entry.chunks;
+			entry.chunks = 0;
+			m_free_entries.push_back(index);
+		}
+
+		// the source and destination ranges might overlap, hence the temporary
+		template<class T>
+		static void relocate(void* dst, void* src)
+		{
+			T* t = static_cast<T*>(src);
+			T tmp(std::move(*t));
+			t->~T();
+			new (dst) T(std::move(tmp));
+		}
+
+		template<class T>
+		static void destroy(void* ptr)
+		{
+			static_cast<T*>(ptr)->~T();
+		}
+	};
+
+	struct MemoryPoolStats
+	{
+		// allocations[i] counts the allocations of (2^(i-1), 2^i] bytes, the last bucket counts everything larger
+		enum : size_t { BUCKETS = 16 };
+
+		uint64_t allocations[BUCKETS] = {};
+		uint64_t deallocations = 0;
+		uint64_t failed_allocations = 0;
+		uint64_t used_memory = 0;
+		uint64_t peak_used_memory = 0;
+		uint64_t free_memory = 0;
+		uint64_t largest_free_block = 0;
+		float fragmentation = 0.f; // 1 - largest_free_block / free_memory
+		uint64_t lock_wait_time_ns = 0;
+		uint64_t lock_contentions = 0;
+
+		template<class Serializer>
+		void operator()(Serializer& serializer)
+		{
+			for (auto& count : allocations)
+				serializer(count);
+
+			serializer(deallocations)(failed_allocations)
+				(used_memory)(peak_used_memory)(free_memory)(largest_free_block)(fragmentation)
+				(lock_wait_time_ns)(lock_contentions);
+		}
+	};
+
+	template<class Mutex = std::mutex>
+	class InstrumentedPool : public IMemoryPool
+	{
+	public:
+		// calls to 'pool' are serialized by this layer so the lock wait time can be measured,
+		// which means 'pool' itself doesn't have to be thread-safe (Mutex = void)
+		InstrumentedPool(IMemoryPool* pool) :
+			m_pool(pool)
+		{
+		}
+
+		InstrumentedPool(const InstrumentedPool&) = delete;
+
+		InstrumentedPool& operator=(const InstrumentedPool&) = delete;
+
+		virtual void* allocate(size_t bytes)
+		{
+			Guard guard(this);
+
+			void* ptr;
+			try
+			{
+				ptr = m_pool->allocate(bytes);
+			}
+			catch (std::bad_alloc&)
+			{
+				++m_stats.failed_allocations;
+				throw;
+			}
+
+			onAllocated(bytes);
+			return ptr;
+		}
+
+		virtual void deallocate(void* ptr, size_t bytes)
+		{
+			Guard guard(this);
+			m_pool->deallocate(ptr, bytes);
+			onDeallocated();
+		}
+
+		virtual void* allocateAligned(size_t bytes, size_t alignment)
+		{
+			Guard guard(this);
 
-			for (size_t i = starting_chunk; i < starting_chunk + chunks; ++i)
+			void* ptr;
+			try
+			{
+				ptr = m_pool->allocateAligned(bytes, alignment);
+			}
+			catch (std::bad_alloc&)
 			{
-				m_chunks.unset(i);
+				++m_stats.failed_allocations;
+				throw;
 			}
+
+			onAllocated(bytes);
+			return ptr;
+		}
+
+		virtual void deallocateAligned(void* ptr, size_t bytes, size_t alignment)
+		{
+			Guard guard(this);
+			m_pool->deallocateAligned(ptr, bytes, alignment);
+			onDeallocated();
 		}
 
 		virtual size_t getFreeMemory() const
 		{
-			return (m_chunks.falsebits().count() * ALIGNMENT);
+			Guard guard(this);
+			return m_pool->getFreeMemory();
 		}
 
 		virtual size_t getUsedMemory() const
 		{
-			return (m_chunks.truebits().count() * ALIGNMENT);
+			Guard guard(this);
+			return m_pool->getUsedMemory();
+		}
+
+		virtual size_t getLargestFreeBlock() const
+		{
+			Guard guard(this);
+			return m_pool->getLargestFreeBlock();
+		}
+
+		virtual FreeRunHistogram getFreeRunHistogram() const
+		{
+			Guard guard(this);
+			return m_pool->getFreeRunHistogram();
+		}
+
+		MemoryPoolStats getStats() const
+		{
+			Guard guard(this);
+
+			MemoryPoolStats stats = m_stats;
+			stats.used_memory = m_pool->getUsedMemory();
+			stats.free_memory = m_pool->getFreeMemory();
+			stats.largest_free_block = m_pool->getLargestFreeBlock();
+			stats.fragmentation = (stats.free_memory > 0) ?
+				1.f - static_cast<float>(stats.largest_free_block) / static_cast<float>(stats.free_memory) : 0.f;
+			stats.lock_wait_time_ns = m_lock_wait_time_ns;
+			stats.lock_contentions = m_lock_contentions;
+			return stats;
+		}
+
+		void resetStats()
+		{
+			Guard guard(this);
+			m_stats = MemoryPoolStats();
+			m_stats.peak_used_memory = m_pool->getUsedMemory();
+			m_lock_wait_time_ns = 0;
+			m_lock_contentions = 0;
 		}
 
 	private:
 		struct DummyMutex
 		{
 			void lock() {};
+			bool try_lock() { return true; };
 			void unlock() {};
 		};
 
 		typedef std::conditional_t<std::is_same<Mutex, void>::value, DummyMutex, Mutex> Lock;
 
-		Bitset<SIZE / ALIGNMENT> m_chunks;
-		Lock m_lock;
-		char m_memory[SIZE];
+		class Guard
+		{
+		public:
+			Guard(const InstrumentedPool* pool) : m_pool(pool)
+			{
+				if (m_pool->m_lock.try_lock())
+					return;
+
+				auto start = std::chrono::steady_clock::now();
+				m_pool->m_lock.lock();
+				auto wait_time = std::chrono::steady_clock::now() - start;
+
+				// these are only modified while holding the lock
+				m_pool->m_lock_wait_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(wait_time).count();
+				++m_pool->m_lock_contentions;
+			}
+
+			~Guard()
+			{
+				m_pool->m_lock.unlock();
+			}
+
+		private:
+			const InstrumentedPool* m_pool;
+		};
+
+		IMemoryPool* m_pool;
+		mutable Lock m_lock;
+		mutable uint64_t m_lock_wait_time_ns = 0;
+		mutable uint64_t m_lock_contentions = 0;
+		MemoryPoolStats m_stats;
+
+		void onAllocated(size_t bytes)
+		{
+			size_t bucket = 0;
+			while (bucket < MemoryPoolStats::BUCKETS - 1 && (size_t(1) << bucket) < bytes)
+				++bucket;
+
+			++m_stats.allocations[bucket];
+
+			const uint64_t used_memory = m_pool->getUsedMemory();
+			if (used_memory > m_stats.peak_used_memory)
+				m_stats.peak_used_memory = used_memory;
+		}
+
+		void onDeallocated()
+		{
+			++m_stats.deallocations;
+		}
 	};
 
 	template<class T>
@@ -168,7 +2019,11 @@ namespace raz
 		T* allocate(size_t n)
 		{
 			if (m_memory)
-				return reinterpret_cast<T*>(m_memory->allocate(n * sizeof(T)));
+				return reinterpret_cast<T*>(m_memory->allocateAligned(n * sizeof(T), alignof(T)));
+#ifdef __cpp_aligned_new
+			else if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+				return reinterpret_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+#endif
 			else
 				return reinterpret_cast<T*>(::operator new(n * sizeof(T)));
 		}
@@ -176,9 +2031,13 @@ namespace raz
 		void deallocate(T* ptr, size_t n)
 		{
 			if (m_memory)
-				m_memory->deallocate(ptr, n * sizeof(T));
+				m_memory->deallocateAligned(ptr, n * sizeof(T), alignof(T));
+#ifdef __cpp_aligned_new
+			else if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+				::operator delete(ptr, std::align_val_t(alignof(T)));
+#endif
 			else
-				delete reinterpret_cast<void*>(ptr);
+				::operator delete(ptr);
 		}
 
 		IMemoryPool* getMemoryPool() const
@@ -205,6 +2064,85 @@ namespace raz
 		friend class Allocator;
 	};
 
+	template<class T>
+	class PoolDeleter
+	{
+	public:
+		PoolDeleter() :
+			m_memory(nullptr), m_block(nullptr), m_size(0), m_alignment(0)
+		{
+		}
+
+		PoolDeleter(IMemoryPool* memory, void* block, size_t size, size_t alignment) :
+			m_memory(memory), m_block(block), m_size(size), m_alignment(alignment)
+		{
+		}
+
+		// the original block is remembered, so PoolPtr<Derived> converts to PoolPtr<Base>
+		template<class U, class = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+		PoolDeleter(const PoolDeleter<U>& other) :
+			m_memory(other.m_memory), m_block(other.m_block), m_size(other.m_size), m_alignment(other.m_alignment)
+		{
+		}
+
+		void operator()(T* t) const
+		{
+			t->~T();
+
+			if (m_memory)
+				m_memory->deallocateAligned(m_block, m_size, m_alignment);
+#ifdef __cpp_aligned_new
+			else if (m_alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+				::operator delete(m_block, std::align_val_t(m_alignment));
+#endif
+			else
+				::operator delete(m_block);
+		}
+
+		IMemoryPool* getMemoryPool() const
+		{
+			return m_memory;
+		}
+
+	private:
+		IMemoryPool* m_memory;
+		void* m_block;
+		size_t m_size;
+		size_t m_alignment;
+
+		template<class U>
+		friend class PoolDeleter;
+	};
+
+	template<class T>
+	using PoolPtr = std::unique_ptr<T, PoolDeleter<T>>;
+
+	template<class T, class... Args>
+	PoolPtr<T> make_pooled(IMemoryPool* memory, Args&&... args)
+	{
+		raz::Allocator<T> alloc(memory);
+		T* t = alloc.allocate(1);
+
+		try
+		{
+			new (t) T(std::forward<Args>(args)...);
+		}
+		catch (...)
+		{
+			alloc.deallocate(t, 1);
+			throw;
+		}
+
+		return PoolPtr<T>(t, PoolDeleter<T>(memory, t, sizeof(T), alignof(T)));
+	}
+
+	// the control block and the object share a single allocation from 'memory'
+	template<class T, class... Args>
+	std::shared_ptr<T> allocate_shared(IMemoryPool* memory, Args&&... args)
+	{
+		return std::allocate_shared<T>(raz::Allocator<T>(memory), std::forward<Args>(args)...);
+	}
+
 	namespace literal
 	{
 		constexpr unsigned long long operator"" _KB(unsigned long long size)
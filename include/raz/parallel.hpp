@@ -0,0 +1,254 @@
+/*
+Copyright (C) Gbor "Razzie" Grzsny
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "raz/memory.hpp"
+#include "raz/thread.hpp"
+
+namespace raz
+{
+	// grain = 0 means the ranges are sized automatically (~8 ranges per worker)
+	// the right half of every split range is submitted as a task, the left half is processed by the current thread
+
+	inline size_t getParallelGrain(const TaskManager& taskmgr, size_t count, size_t grain)
+	{
+		if (grain > 0)
+			return grain;
+
+		grain = count / (taskmgr.getWorkerCount() * 8);
+		return (grain > 0) ? grain : 1;
+	}
+
+	// calls fn(i) for every i in [first, last), where Index is an integer or a random access iterator
+	template<class Index, class F>
+	void parallel_for(TaskManager& taskmgr, Index first, Index last, F fn, size_t grain = 0)
+	{
+		if (!(first < last))
+			return;
+
+		const size_t count = static_cast<size_t>(last - first);
+		grain = getParallelGrain(taskmgr, count, grain);
+
+		if (count <= grain)
+		{
+			for (; first != last; ++first)
+				fn(first);
+
+			return;
+		}
+
+		const Index middle = first + (last - first) / 2;
+		auto right = taskmgr([&taskmgr, middle, last, &fn, grain] { parallel_for(taskmgr, middle, last, std::ref(fn), grain); });
+
+		try
+		{
+			parallel_for(taskmgr, first, middle, std::ref(fn), grain);
+		}
+		catch (...)
+		{
+			right.wait();
+			throw;
+		}
+
+		right.get();
+	}
+
+	// reduces the elements with op (which must be associative), init is combined with the result of the range
+	// the partial results of the subranges are combined with op(T, T), and each subrange except the first one
+	// starts from T(its first element), so op(T, element) has to match op(T, T(element)), e.g. summing
+	// with a wider type is fine, but counting elements or summing their sizes needs parallel_transform first
+	template<class Iterator, class T, class BinaryOp>
+	T parallel_reduce(TaskManager& taskmgr, Iterator first, Iterator last, T init, BinaryOp op, size_t grain = 0)
+	{
+		static_assert(std::is_constructible<T, typename std::iterator_traits<Iterator>::reference>::value,
+			"parallel_reduce: T has to be constructible from the elements");
+		static_assert(std::is_convertible<decltype(op(std::declval<T>(), std::declval<T>())), T>::value,
+			"parallel_reduce: op has to combine two partial results, op(T, T) -> T");
+
+		if (first == last)
+			return init;
+
+		const size_t count = static_cast<size_t>(std::distance(first, last));
+		grain = getParallelGrain(taskmgr, count, grain);
+
+		if (count <= grain)
+		{
+			for (; first != last; ++first)
+				init = op(init, *first);
+
+			return init;
+		}
+
+		const Iterator middle = std::next(first, count / 2);
+
+		// the right half starts from its own first element, so no identity value is needed (see above)
+		auto right = taskmgr([&taskmgr, middle, last, &op, grain]
+		{
+			return parallel_reduce(taskmgr, std::next(middle), last, T(*middle), std::ref(op), grain);
+		});
+
+		try
+		{
+			T left = parallel_reduce(taskmgr, first, middle, std::move(init), std::ref(op), grain);
+			return op(std::move(left), right.get());
+		}
+		catch (...)
+		{
+			right.wait();
+			throw;
+		}
+	}
+
+	template<class Iterator, class T>
+	T parallel_reduce(TaskManager& taskmgr, Iterator first, Iterator last, T init, size_t grain = 0)
+	{
+		return parallel_reduce(taskmgr, first, last, std::move(init), std::plus<T>(), grain);
+	}
+
+	// *(d_first + i) = fn(*(first + i)) for every element, both iterators must be random access
+	template<class InputIterator, class OutputIterator, class F>
+	OutputIterator parallel_transform(TaskManager& taskmgr, InputIterator first, InputIterator last, OutputIterator d_first, F fn, size_t grain = 0)
+	{
+		const auto count = last - first;
+
+		parallel_for(taskmgr, decltype(count)(0), count,
+			[first, d_first, &fn](decltype(count) i) { *(d_first + i) = fn(*(first + i)); },
+			getParallelGrain(taskmgr, static_cast<size_t>(count), grain));
+
+		return (d_first + count);
+	}
+
+	// merges [first1, last1) and [first2, last2) into d_first by splitting the larger range at its middle
+	template<class Iterator, class OutputIterator, class Compare>
+	void parallel_merge(TaskManager& taskmgr, Iterator first1, Iterator last1, Iterator first2, Iterator last2,
+		OutputIterator d_first, Compare comp, size_t grain)
+	{
+		const size_t count1 = static_cast<size_t>(last1 - first1);
+		const size_t count2 = static_cast<size_t>(last2 - first2);
+
+		if (count1 + count2 <= grain)
+		{
+			std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+				std::make_move_iterator(first2), std::make_move_iterator(last2), d_first, comp);
+			return;
+		}
+
+		// elements that are equal to the pivot stay in front of it if they come from the first range (stable merge)
+		Iterator middle1, middle2;
+		if (count1 >= count2)
+		{
+			middle1 = first1 + (count1 / 2);
+			middle2 = std::lower_bound(first2, last2, *middle1, comp);
+		}
+		else
+		{
+			middle2 = first2 + (count2 / 2);
+			middle1 = std::upper_bound(first1, last1, *middle2, comp);
+		}
+
+		OutputIterator d_middle = d_first + ((middle1 - first1) + (middle2 - first2));
+
+		auto right = taskmgr([=, &taskmgr] { parallel_merge(taskmgr, middle1, last1, middle2, last2, d_middle, comp, grain); });
+
+		try
+		{
+			parallel_merge(taskmgr, first1, middle1, first2, middle2, d_first, comp, grain);
+		}
+		catch (...)
+		{
+			right.wait();
+			throw;
+		}
+
+		right.get();
+	}
+
+	// sorts the elements of [first, last), the result ends up in d_first if 'to_destination' is set
+	// otherwise in [first, last), the other range is used as the merge buffer
+	template<class Iterator, class OutputIterator, class Compare>
+	void parallel_merge_sort(TaskManager& taskmgr, Iterator first, Iterator last, OutputIterator d_first, bool to_destination,
+		Compare comp, size_t grain)
+	{
+		const size_t count = static_cast<size_t>(last - first);
+
+		if (count <= grain)
+		{
+			std::stable_sort(first, last, comp);
+			if (to_destination)
+				std::move(first, last, d_first);
+
+			return;
+		}
+
+		// the halves are sorted into the buffer that isn't the final destination, then merged into it
+		Iterator middle = first + (count / 2);
+		OutputIterator d_middle = d_first + (count / 2);
+		OutputIterator d_last = d_first + count;
+
+		auto right = taskmgr([=, &taskmgr] { parallel_merge_sort(taskmgr, middle, last, d_middle, !to_destination, comp, grain); });
+
+		try
+		{
+			parallel_merge_sort(taskmgr, first, middle, d_first, !to_destination, comp, grain);
+		}
+		catch (...)
+		{
+			right.wait();
+			throw;
+		}
+
+		right.get();
+
+		if (to_destination)
+			parallel_merge(taskmgr, first, middle, middle, last, d_first, comp, grain);
+		else
+			parallel_merge(taskmgr, d_first, d_middle, d_middle, d_last, first, comp, grain);
+	}
+
+	// stable merge sort, the temporary buffer is allocated from 'memory'
+	template<class Iterator, class Compare>
+	void parallel_sort(TaskManager& taskmgr, Iterator first, Iterator last, Compare comp, size_t grain = 0, IMemoryPool* memory = nullptr)
+	{
+		typedef typename std::iterator_traits<Iterator>::value_type T;
+
+		const size_t count = static_cast<size_t>(last - first);
+		if (count < 2)
+			return;
+
+		grain = std::max<size_t>(getParallelGrain(taskmgr, count, grain), 2);
+
+		std::vector<T, raz::Allocator<T>> buffer(std::make_move_iterator(first), std::make_move_iterator(last), raz::Allocator<T>(memory));
+		parallel_merge_sort(taskmgr, buffer.begin(), buffer.end(), first, true, comp, grain);
+	}
+
+	template<class Iterator>
+	void parallel_sort(TaskManager& taskmgr, Iterator first, Iterator last)
+	{
+		parallel_sort(taskmgr, first, last, std::less<typename std::iterator_traits<Iterator>::value_type>());
+	}
+}
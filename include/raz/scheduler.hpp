@@ -0,0 +1,511 @@
+/*
+Copyright (C) Gbor "Razzie" Grzsny
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "raz/memory.hpp"
+#include "raz/thread.hpp"
+
+namespace raz
+{
+	class Scheduler;
+
+	class TimerHandle
+	{
+	public:
+		TimerHandle() :
+			m_timer(nullptr)
+		{
+		}
+
+		TimerHandle(const TimerHandle& other) :
+			m_timer(other.m_timer)
+		{
+			if (m_timer)
+				m_timer->addRef();
+		}
+
+		TimerHandle(TimerHandle&& other) :
+			m_timer(other.m_timer)
+		{
+			other.m_timer = nullptr;
+		}
+
+		~TimerHandle()
+		{
+			if (m_timer)
+				m_timer->release();
+		}
+
+		TimerHandle& operator=(TimerHandle other)
+		{
+			std::swap(m_timer, other.m_timer);
+			return *this;
+		}
+
+		// the callback doesn't run anymore after this returns, unless it is already running
+		// the timer is dropped from the scheduler the next time it would expire
+		void cancel()
+		{
+			if (m_timer)
+				m_timer->cancelled.store(true, std::memory_order_release);
+		}
+
+		// false if the timer is cancelled or it was a one-shot timer that already fired
+		bool isActive() const
+		{
+			return (m_timer && !m_timer->cancelled.load(std::memory_order_acquire) && !m_timer->finished.load(std::memory_order_acquire));
+		}
+
+		explicit operator bool() const
+		{
+			return (m_timer != nullptr);
+		}
+
+	private:
+		friend class Scheduler;
+
+		class TimerBase
+		{
+		public:
+			TimerBase* next = nullptr; // in the wheel slot
+			uint64_t expiry = 0;       // in ticks
+			uint64_t period = 0;       // in ticks, 0 for one-shot timers
+			uint64_t grid = 1;         // expiry is rounded up to this many ticks
+			TaskPriority priority = NORMAL;
+			std::atomic<bool> cancelled{ false };
+			std::atomic<bool> finished{ false };
+			std::atomic<bool> pending{ false }; // posted to the TaskManager, but not finished yet
+
+			TimerBase(IMemoryPool* memory) :
+				m_memory(memory),
+				m_refs(1)
+			{
+			}
+
+			virtual ~TimerBase() = default;
+
+			virtual void run() = 0;
+
+			void addRef()
+			{
+				m_refs.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void release()
+			{
+				if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					destroy(m_memory);
+			}
+
+		protected:
+			virtual void destroy(IMemoryPool* memory) = 0;
+
+		private:
+			IMemoryPool* m_memory;
+			std::atomic<size_t> m_refs;
+		};
+
+		template<class F>
+		class FunctionTimer : public TimerBase
+		{
+		public:
+			FunctionTimer(IMemoryPool* memory, F&& fn) :
+				TimerBase(memory),
+				m_fn(std::move(fn))
+			{
+			}
+
+			virtual void run()
+			{
+				m_fn();
+			}
+
+		protected:
+			virtual void destroy(IMemoryPool* memory)
+			{
+				raz::Allocator<FunctionTimer> alloc(memory);
+				this->~FunctionTimer();
+				alloc.deallocate(this, 1);
+			}
+
+		private:
+			F m_fn;
+		};
+
+		// takes over the reference
+		explicit TimerHandle(TimerBase* timer) :
+			m_timer(timer)
+		{
+		}
+
+		TimerBase* m_timer;
+	};
+
+	// runs delayed and repeating functions on a TaskManager
+	// the timers are kept in a hierarchical timing wheel, so scheduling and expiry are O(1) no matter how many timers there are
+	// the scheduler thread only wakes up when a timer expires (or at most once every LEVEL_SLOTS ticks to cascade the wheel)
+	class Scheduler
+	{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		enum : size_t
+		{
+			LEVELS = 4,
+			LEVEL_BITS = 8,
+			LEVEL_SLOTS = (1 << LEVEL_BITS)
+		};
+
+		// 'resolution' is the length of one tick, timers fire at the end of the tick they expire in
+		// the timers are allocated from 'memory', or from the memory pool of the TaskManager if it's null
+		Scheduler(TaskManager& taskmgr, Clock::duration resolution = std::chrono::milliseconds(1), IMemoryPool* memory = nullptr) :
+			m_taskmgr(taskmgr),
+			m_memory(memory ? memory : taskmgr.getMemoryPool()),
+			m_resolution((resolution.count() > 0) ? resolution : Clock::duration(1)),
+			m_start(Clock::now()),
+			m_tick(0),
+			m_timers(0),
+			m_wakeup(UINT64_MAX),
+			m_exit(false)
+		{
+			for (auto& level : m_wheel)
+			{
+				for (auto& slot : level)
+					slot = nullptr;
+			}
+
+			ThreadConfig config;
+			config.name = "raz-scheduler";
+			m_thread = NativeThread(config, &Scheduler::run, this);
+		}
+
+		Scheduler(const Scheduler&) = delete;
+
+		Scheduler& operator=(const Scheduler&) = delete;
+
+		// the timers that haven't fired yet are dropped
+		~Scheduler()
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_exit = true;
+				m_notifier.notify_all();
+			}
+
+			m_thread.join();
+
+			for (auto& level : m_wheel)
+			{
+				for (auto& slot : level)
+				{
+					while (TimerHandle::TimerBase* timer = slot)
+					{
+						slot = timer->next;
+						timer->release();
+					}
+				}
+			}
+		}
+
+		// fn() runs on the TaskManager after 'delay', it must not throw
+		// timers with the same nonzero 'tolerance' are aligned to a common grid, so the ones expiring close to
+		// each other fire together and the scheduler wakes up less often. fn() may be late by up to 'tolerance'
+		template<class F>
+		TimerHandle schedule(Clock::duration delay, F fn, Clock::duration tolerance = Clock::duration::zero(), TaskPriority priority = NORMAL)
+		{
+			return scheduleAt(Clock::now() + delay, std::move(fn), tolerance, priority);
+		}
+
+		template<class F>
+		TimerHandle scheduleAt(Clock::time_point time, F fn, Clock::duration tolerance = Clock::duration::zero(), TaskPriority priority = NORMAL)
+		{
+			return add(time, Clock::duration::zero(), std::move(fn), tolerance, priority);
+		}
+
+		// fn() runs every 'period', starting one period from now, until the timer is cancelled
+		// if fn() is still queued or running when the next period expires, that run is skipped, so missed runs
+		// of a slow timer are coalesced into one
+		template<class F>
+		TimerHandle scheduleEvery(Clock::duration period, F fn, Clock::duration tolerance = Clock::duration::zero(), TaskPriority priority = NORMAL)
+		{
+			return add(Clock::now() + period, period, std::move(fn), tolerance, priority);
+		}
+
+		// cancelled timers are counted until the time they would expire
+		size_t getTimerCount() const
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_timers;
+		}
+
+		Clock::duration getResolution() const
+		{
+			return m_resolution;
+		}
+
+	private:
+		typedef TimerHandle::TimerBase TimerBase;
+
+		TaskManager& m_taskmgr;
+		IMemoryPool* m_memory;
+		Clock::duration m_resolution;
+		Clock::time_point m_start;
+		uint64_t m_tick;   // the next tick to process
+		size_t m_timers;   // in the wheel
+		uint64_t m_wakeup; // the tick the scheduler thread sleeps until
+		bool m_exit;
+		TimerBase* m_wheel[LEVELS][LEVEL_SLOTS];
+		mutable std::mutex m_mutex;
+		std::condition_variable m_notifier;
+		NativeThread m_thread;
+
+		template<class F>
+		TimerHandle add(Clock::time_point time, Clock::duration period, F&& fn, Clock::duration tolerance, TaskPriority priority)
+		{
+			typedef TimerHandle::FunctionTimer<std::decay_t<F>> TimerType;
+
+			raz::Allocator<TimerType> alloc(m_memory);
+			TimerType* timer = alloc.allocate(1);
+
+			try
+			{
+				new (timer) TimerType(m_memory, std::forward<F>(fn));
+			}
+			catch (...)
+			{
+				alloc.deallocate(timer, 1);
+				throw;
+			}
+
+			TimerHandle handle(timer);
+			timer->period = (period.count() > 0) ? std::max<uint64_t>(1, toTicks(period)) : 0;
+			timer->grid = std::max<uint64_t>(1, tolerance / m_resolution);
+			timer->priority = priority;
+
+			std::lock_guard<std::mutex> guard(m_mutex);
+
+			// an empty wheel doesn't advance while the scheduler thread sleeps
+			if (m_timers == 0)
+				m_tick = std::max(m_tick, getTick(Clock::now()));
+
+			timer->addRef(); // the wheel's reference
+			timer->expiry = alignExpiry(timer, (time > m_start) ? toTicks(time - m_start) : 0);
+			insert(timer);
+			++m_timers;
+
+			if (timer->expiry < m_wakeup)
+				m_notifier.notify_one();
+
+			return handle;
+		}
+
+		uint64_t toTicks(Clock::duration duration) const
+		{
+			// rounded up, so timers never fire early
+			return static_cast<uint64_t>((duration + m_resolution - Clock::duration(1)) / m_resolution);
+		}
+
+		uint64_t getTick(Clock::time_point time) const
+		{
+			return static_cast<uint64_t>((time - m_start) / m_resolution);
+		}
+
+		uint64_t alignExpiry(const TimerBase* timer, uint64_t expiry) const
+		{
+			expiry = std::max(expiry, m_tick);
+
+			if (timer->grid > 1)
+				expiry = (expiry + timer->grid - 1) / timer->grid * timer->grid;
+
+			return expiry;
+		}
+
+		void insert(TimerBase* timer)
+		{
+			const uint64_t delta = timer->expiry - m_tick;
+
+			size_t level = 0;
+			while (level < LEVELS - 1 && (delta >> (LEVEL_BITS * (level + 1))) > 0)
+				++level;
+
+			// timers beyond the range of the wheel are parked in the last slot of the top level,
+			// and they are put back to the right place when that slot is cascaded
+			uint64_t expiry = timer->expiry;
+			if (level == LEVELS - 1 && (delta >> (LEVEL_BITS * LEVELS)) > 0)
+				expiry = m_tick + (uint64_t(1) << (LEVEL_BITS * LEVELS)) - 1;
+
+			TimerBase*& slot = m_wheel[level][(expiry >> (LEVEL_BITS * level)) & (LEVEL_SLOTS - 1)];
+			timer->next = slot;
+			slot = timer;
+		}
+
+		// moves the timers of the upper levels down when the lower level wraps around
+		void cascade()
+		{
+			for (size_t level = 1; level < LEVELS; ++level)
+			{
+				const uint64_t index = m_tick >> (LEVEL_BITS * level);
+
+				TimerBase* timer = m_wheel[level][index & (LEVEL_SLOTS - 1)];
+				m_wheel[level][index & (LEVEL_SLOTS - 1)] = nullptr;
+
+				while (timer)
+				{
+					TimerBase* next = timer->next;
+					insert(timer);
+					timer = next;
+				}
+
+				if ((index & (LEVEL_SLOTS - 1)) != 0)
+					break;
+			}
+		}
+
+		// processes the ticks up to 'now', the expired timers are moved to 'expired' with the wheel's reference
+		void advance(uint64_t now, std::vector<TimerBase*>& expired)
+		{
+			while (m_tick <= now && m_timers > 0)
+			{
+				if ((m_tick & (LEVEL_SLOTS - 1)) == 0)
+					cascade();
+
+				TimerBase*& slot = m_wheel[0][m_tick & (LEVEL_SLOTS - 1)];
+				TimerBase* timer = slot;
+				slot = nullptr;
+
+				while (timer)
+				{
+					TimerBase* next = timer->next;
+					timer->next = nullptr;
+
+					if (timer->cancelled.load(std::memory_order_acquire))
+					{
+						--m_timers;
+						timer->release();
+					}
+					else if (timer->period > 0)
+					{
+						// repeating timers stay in the wheel, missed periods are skipped
+						timer->addRef();
+						expired.push_back(timer);
+
+						const uint64_t periods = (m_tick - timer->expiry) / timer->period + 1;
+						timer->expiry = alignExpiry(timer, timer->expiry + periods * timer->period);
+						insert(timer);
+					}
+					else
+					{
+						--m_timers;
+						expired.push_back(timer);
+					}
+
+					timer = next;
+				}
+
+				++m_tick;
+			}
+
+			if (m_timers == 0)
+				m_tick = std::max(m_tick, now + 1);
+		}
+
+		// the next tick that has a timer in the lowest level, or the next cascade
+		uint64_t getNextWakeup() const
+		{
+			if (m_timers == 0)
+				return UINT64_MAX;
+
+			// the upper levels are only cascaded when this tick is processed, so their timers aren't in the lowest level yet
+			if ((m_tick & (LEVEL_SLOTS - 1)) == 0)
+				return m_tick;
+
+			const uint64_t cascade_tick = (m_tick | (LEVEL_SLOTS - 1)) + 1;
+			for (uint64_t tick = m_tick; tick < cascade_tick; ++tick)
+			{
+				if (m_wheel[0][tick & (LEVEL_SLOTS - 1)])
+					return tick;
+			}
+
+			return cascade_tick;
+		}
+
+		void dispatch(TimerBase* timer)
+		{
+			// the wheel's reference (or the extra one of repeating timers) is passed to the task
+			TimerHandle handle(timer);
+
+			if (timer->period > 0 && timer->pending.exchange(true, std::memory_order_acq_rel))
+				return;
+
+			m_taskmgr.post([handle]() mutable
+			{
+				TimerBase* timer = handle.m_timer;
+				if (!timer->cancelled.load(std::memory_order_acquire))
+					timer->run();
+
+				if (timer->period > 0)
+					timer->pending.store(false, std::memory_order_release);
+				else
+					timer->finished.store(true, std::memory_order_release);
+			}, timer->priority);
+		}
+
+		void run()
+		{
+			std::vector<TimerBase*> expired;
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (!m_exit)
+			{
+				advance(getTick(Clock::now()), expired);
+
+				if (!expired.empty())
+				{
+					// the functions can run on this thread (if the TaskManager runs them inline), and they may add new timers
+					lock.unlock();
+					for (auto timer : expired)
+						dispatch(timer);
+					expired.clear();
+					lock.lock();
+					continue;
+				}
+
+				m_wakeup = getNextWakeup();
+				if (m_wakeup == UINT64_MAX)
+					m_notifier.wait(lock);
+				else
+					m_notifier.wait_until(lock, m_start + m_resolution * m_wakeup);
+				m_wakeup = UINT64_MAX;
+			}
+		}
+	};
+}
@@ -21,13 +21,45 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE
 
 #pragma once
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <exception>
+#include <fstream>
 #include <functional>
+#include <iterator>
 #include <future>
-#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
+#include "raz/hash.hpp"
 #include "raz/memory.hpp"
 
 namespace raz
@@ -36,16 +68,423 @@ namespace raz
 	{
 	};
 
+	enum WakeupMode
+	{
+		PARK,          // idle threads sleep until they are notified
+		SPIN_THEN_PARK // idle threads spin for a short while before going to sleep (lower latency, more CPU usage)
+	};
+
+	struct ThreadConfig
+	{
+		std::string name;          // shows up in debuggers and profilers (15 characters max. on Linux)
+		std::vector<unsigned> cpus; // the thread is pinned to these CPUs, or can run anywhere if empty
+		size_t stack_size = 0;     // 0 means the platform default
+	};
+
+	struct CpuInfo
+	{
+		unsigned cpu;
+		unsigned core;    // physical core id within the package
+		unsigned package; // socket
+		unsigned node;    // NUMA node
+	};
+
+	namespace detail
+	{
+#ifndef _WIN32
+		inline bool readSysValue(const std::string& path, std::string& value)
+		{
+			std::ifstream file(path);
+			return static_cast<bool>(std::getline(file, value));
+		}
+
+		// parses lists like "0-3,8,10-11"
+		inline std::vector<unsigned> parseCpuList(const std::string& list)
+		{
+			std::vector<unsigned> cpus;
+			size_t pos = 0;
+
+			while (pos < list.size())
+			{
+				size_t end = list.find(',', pos);
+				if (end == std::string::npos)
+					end = list.size();
+
+				const std::string range = list.substr(pos, end - pos);
+				const size_t dash = range.find('-');
+
+				try
+				{
+					const unsigned first = static_cast<unsigned>(std::stoul(range.substr(0, dash)));
+					const unsigned last = (dash == std::string::npos) ? first : static_cast<unsigned>(std::stoul(range.substr(dash + 1)));
+
+					for (unsigned cpu = first; cpu <= last; ++cpu)
+						cpus.push_back(cpu);
+				}
+				catch (std::exception&)
+				{
+				}
+
+				pos = end + 1;
+			}
+
+			return cpus;
+		}
+
+		inline unsigned readSysId(const std::string& path)
+		{
+			std::string value;
+			if (!readSysValue(path, value))
+				return 0;
+
+			try
+			{
+				const long id = std::stol(value);
+				return (id < 0) ? 0 : static_cast<unsigned>(id);
+			}
+			catch (std::exception&)
+			{
+				return 0;
+			}
+		}
+
+		inline unsigned readCpuNode(const std::string& cpu_path)
+		{
+			unsigned node = 0;
+
+			if (DIR* dir = opendir(cpu_path.c_str()))
+			{
+				while (dirent* entry = readdir(dir))
+				{
+					if (std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+					{
+						node = static_cast<unsigned>(std::strtoul(entry->d_name + 4, nullptr, 10));
+						break;
+					}
+				}
+
+				closedir(dir);
+			}
+
+			return node;
+		}
+#endif
+	}
+
+	// reads the online CPUs from /sys/devices/system/cpu, returns an empty vector if it isn't available
+	inline std::vector<CpuInfo> getCpuTopology()
+	{
+		std::vector<CpuInfo> topology;
+
+#ifndef _WIN32
+		std::string online;
+		if (!detail::readSysValue("/sys/devices/system/cpu/online", online))
+			return topology;
+
+		for (unsigned cpu : detail::parseCpuList(online))
+		{
+			const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+
+			CpuInfo info;
+			info.cpu = cpu;
+			info.core = detail::readSysId(path + "/topology/core_id");
+			info.package = detail::readSysId(path + "/topology/physical_package_id");
+			info.node = detail::readCpuNode(path);
+			topology.push_back(info);
+		}
+#endif
+
+		return topology;
+	}
+
+	// one CPU per worker, grouped by NUMA node, using every physical core before their hyperthreads
+	// at most 'workers_per_node' CPUs are used from a node (0 means one per physical core)
+	// returns an empty vector if the topology isn't available
+	inline std::vector<std::vector<unsigned>> getTopologyLayout(size_t workers_per_node = 0)
+	{
+		std::map<unsigned, std::vector<CpuInfo>> nodes;
+		for (const auto& info : getCpuTopology())
+			nodes[info.node].push_back(info);
+
+		std::vector<std::vector<unsigned>> layout;
+
+		for (auto& node : nodes)
+		{
+			// the n-th hyperthread of every core comes before the (n+1)-th hyperthread of any core
+			std::map<std::pair<unsigned, unsigned>, unsigned> siblings;
+			std::vector<std::pair<unsigned, CpuInfo>> cpus;
+			for (const auto& info : node.second)
+				cpus.emplace_back(siblings[std::make_pair(info.package, info.core)]++, info);
+
+			std::stable_sort(cpus.begin(), cpus.end(),
+				[](const std::pair<unsigned, CpuInfo>& a, const std::pair<unsigned, CpuInfo>& b) { return (a.first < b.first); });
+
+			const size_t count = std::min(cpus.size(), (workers_per_node > 0) ? workers_per_node : siblings.size());
+			for (size_t i = 0; i < count; ++i)
+				layout.push_back(std::vector<unsigned>(1, cpus[i].second.cpu));
+		}
+
+		return layout;
+	}
+
+	// these return false if the platform doesn't support it or the CPUs aren't available
+	inline bool setCurrentThreadAffinity(const std::vector<unsigned>& cpus)
+	{
+		if (cpus.empty())
+			return true;
+
+#ifdef _WIN32
+		DWORD_PTR mask = 0;
+		for (unsigned cpu : cpus)
+		{
+			if (cpu < sizeof(DWORD_PTR) * 8)
+				mask |= (static_cast<DWORD_PTR>(1) << cpu);
+		}
+
+		return (mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0);
+#else
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		for (unsigned cpu : cpus)
+		{
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &cpuset);
+		}
+
+		return (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0);
+#endif
+	}
+
+	inline bool setCurrentThreadName(const std::string& name)
+	{
+		if (name.empty())
+			return true;
+
+#ifdef _WIN32
+		std::wstring wide_name(name.begin(), name.end());
+		return SUCCEEDED(SetThreadDescription(GetCurrentThread(), wide_name.c_str()));
+#else
+		// longer names are rejected
+		return (pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0);
+#endif
+	}
+
+	// std::thread with a ThreadConfig, the name and affinity are applied by the new thread before calling 'fn'
+	// failing to apply them isn't an error, the thread runs unpinned or unnamed in that case
+	class NativeThread
+	{
+	public:
+		NativeThread() :
+			m_handle(),
+			m_joinable(false)
+		{
+		}
+
+		template<class F, class... Args>
+		explicit NativeThread(const ThreadConfig& config, F&& fn, Args&&... args) :
+			m_handle(),
+			m_joinable(false)
+		{
+			typedef Entry<std::decay_t<F>, std::decay_t<Args>...> EntryType;
+			std::unique_ptr<EntryType> entry(new EntryType(config, std::forward<F>(fn), std::forward<Args>(args)...));
+
+#ifdef _WIN32
+			// unlike CreateThread, _beginthreadex initializes the CRT for the new thread
+			m_handle = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, static_cast<unsigned>(config.stack_size), &NativeThread::start, entry.get(),
+				(config.stack_size > 0) ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, nullptr));
+			if (!m_handle)
+				throw std::system_error(errno, std::generic_category(), "_beginthreadex");
+#else
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+
+			int error = 0;
+			if (config.stack_size > 0)
+				error = pthread_attr_setstacksize(&attr, config.stack_size);
+
+			if (!error)
+				error = pthread_create(&m_handle, &attr, &NativeThread::start, entry.get());
+
+			pthread_attr_destroy(&attr);
+
+			if (error)
+				throw std::system_error(error, std::system_category(), "pthread_create");
+#endif
+
+			entry.release();
+			m_joinable = true;
+		}
+
+		NativeThread(const NativeThread&) = delete;
+
+		NativeThread(NativeThread&& other) noexcept :
+			m_handle(other.m_handle),
+			m_joinable(other.m_joinable)
+		{
+			other.m_joinable = false;
+		}
+
+		~NativeThread()
+		{
+			if (m_joinable)
+				std::terminate();
+		}
+
+		NativeThread& operator=(const NativeThread&) = delete;
+
+		NativeThread& operator=(NativeThread&& other) noexcept
+		{
+			if (m_joinable)
+				std::terminate();
+
+			m_handle = other.m_handle;
+			m_joinable = other.m_joinable;
+			other.m_joinable = false;
+			return *this;
+		}
+
+		bool joinable() const
+		{
+			return m_joinable;
+		}
+
+		void join()
+		{
+			if (!m_joinable)
+				throw std::system_error(std::make_error_code(std::errc::invalid_argument), "NativeThread::join");
+
+#ifdef _WIN32
+			WaitForSingleObject(m_handle, INFINITE);
+			CloseHandle(m_handle);
+#else
+			pthread_join(m_handle, nullptr);
+#endif
+			m_joinable = false;
+		}
+
+	private:
+		class EntryBase
+		{
+		public:
+			EntryBase(const ThreadConfig& config) :
+				m_config(config)
+			{
+			}
+
+			virtual ~EntryBase() = default;
+			virtual void run() = 0;
+
+			void setup()
+			{
+				setCurrentThreadName(m_config.name);
+				setCurrentThreadAffinity(m_config.cpus);
+			}
+
+		private:
+			ThreadConfig m_config;
+		};
+
+		template<class F, class... Args>
+		class Entry : public EntryBase
+		{
+		public:
+			template<class FArg, class... CArgs>
+			Entry(const ThreadConfig& config, FArg&& fn, CArgs&&... args) :
+				EntryBase(config),
+				m_fn(std::forward<FArg>(fn)),
+				m_args(std::forward<CArgs>(args)...)
+			{
+			}
+
+			virtual void run()
+			{
+				call(std::index_sequence_for<Args...>());
+			}
+
+		private:
+			F m_fn;
+			std::tuple<Args...> m_args;
+
+			template<size_t... I>
+			void call(std::index_sequence<I...>)
+			{
+				invoke(std::move(m_fn), std::move(std::get<I>(m_args))...);
+			}
+
+			template<class R, class C, class... Params, class Object, class... CArgs>
+			static void invoke(R(C::*fn)(Params...), Object&& object, CArgs&&... args)
+			{
+				((*object).*fn)(std::forward<CArgs>(args)...);
+			}
+
+			template<class Fn, class... CArgs>
+			static void invoke(Fn&& fn, CArgs&&... args)
+			{
+				fn(std::forward<CArgs>(args)...);
+			}
+		};
+
+#ifdef _WIN32
+		HANDLE m_handle;
+
+		static unsigned __stdcall start(void* param)
+#else
+		pthread_t m_handle;
+
+		static void* start(void* param)
+#endif
+		{
+			std::unique_ptr<EntryBase> entry(static_cast<EntryBase*>(param));
+			entry->setup();
+
+			// same as std::thread
+			try
+			{
+				entry->run();
+			}
+			catch (...)
+			{
+				std::terminate();
+			}
+
+			return 0;
+		}
+
+		bool m_joinable;
+	};
+
+	template<class T>
+	class ThreadGroup;
+
 	template<class T>
 	class Thread
 	{
 	public:
 		// please note that IMemoryPool must be thread-safe
-		Thread(IMemoryPool* memory = nullptr) :
+		// objects with operator()() are called once per 'loop_interval', others only wake up for calls
+		// callers wait for free space if there are already 'queue_capacity' pending calls, except the thread itself:
+		// the calls it makes to its own object never block, the ones that don't fit are spilled to an overflow list
+		// 'queue_capacity' = 0 means unbounded, every caller spills instead of waiting (use it for actors calling each other)
+		Thread(IMemoryPool* memory = nullptr, WakeupMode wakeup = PARK,
+			std::chrono::microseconds loop_interval = std::chrono::milliseconds(1), size_t queue_capacity = 1024) :
+			Thread(ThreadConfig(), memory, wakeup, loop_interval, queue_capacity)
+		{
+		}
+
+		// the name, CPU affinity and stack size are applied every time the thread is started
+		Thread(const ThreadConfig& config, IMemoryPool* memory = nullptr, WakeupMode wakeup = PARK,
+			std::chrono::microseconds loop_interval = std::chrono::milliseconds(1), size_t queue_capacity = 1024) :
+			m_config(config),
 			m_memory(memory),
-			m_exit_token(std::allocator_arg, raz::Allocator<int>(memory)),
+			m_wakeup(wakeup),
+			m_loop_interval(loop_interval),
+			m_unbounded(queue_capacity == 0),
+			m_owner(std::thread::id()),
+			m_stop(false),
+			m_sleeping(false),
+			m_clear(false),
 			m_thread_result(std::allocator_arg, raz::Allocator<int>(memory)),
-			m_call_queue(memory)
+			m_call_queue((queue_capacity > 0) ? queue_capacity : 1024, memory)
 		{
 		}
 
@@ -57,7 +496,7 @@ namespace raz
 		{
 			if (m_thread.joinable())
 			{
-				m_exit_token.set_value();
+				signalStop();
 				m_thread.join();
 			}
 		}
@@ -69,13 +508,13 @@ namespace raz
 
 			if (m_thread.joinable())
 			{
-				m_exit_token.set_value();
+				signalStop();
 				m_thread.join();
 			}
 
-			m_exit_token = std::move(std::promise<void>(std::allocator_arg, raz::Allocator<int>(m_memory)));
+			m_stop = false;
 			m_thread_result = std::move(std::promise<void>(std::allocator_arg, raz::Allocator<int>(m_memory)));
-			m_thread = std::thread(&Thread<T>::run<Args...>, this, std::forward<Args>(args)...);
+			m_thread = NativeThread(m_config, &Thread<T>::run<Args...>, this, std::forward<Args>(args)...);
 			return m_thread_result.get_future();
 		}
 
@@ -85,278 +524,3310 @@ namespace raz
 
 			if (m_thread.joinable())
 			{
-				m_exit_token.set_value();
+				signalStop();
 				m_thread.join();
 			}
 		}
 
+		// a running thread drops its pending calls before processing the next ones
 		void clear()
 		{
 			std::lock_guard<std::mutex> guard(m_mutex);
-			m_call_queue.clear();
+
+			if (m_thread.joinable())
+				m_clear = true;
+			else
+				m_call_queue.clear();
 		}
 
+		// the arguments are moved (or copied) into the queue, the object receives them as rvalues
 		template<class... Args>
 		void operator()(Args&&... args)
 		{
-			std::lock_guard<std::mutex> guard(m_mutex);
-			m_call_queue.emplace_back(std::allocator_arg, raz::Allocator<char>(m_memory), [args...](T& object) { object(args...); });
+			const bool may_spill = canSpill();
+			while (!m_call_queue.push(may_spill, std::forward<Args>(args)...))
+				std::this_thread::yield();
+
+			notifyCall();
 		}
 
-	private:
-		typedef std::function<void(T&)> ForwardedCall;
-		typedef std::vector<ForwardedCall, raz::Allocator<ForwardedCall>> ForwardedCallQueue;
+		// fn(object) runs on the thread in order with the other calls, or is dropped with them
+		template<class F>
+		void post(F fn)
+		{
+			const bool may_spill = canSpill();
+			while (!m_call_queue.post(may_spill, std::move(fn)))
+				std::this_thread::yield();
 
-		IMemoryPool* m_memory;
-		std::thread m_thread;
-		std::promise<void> m_exit_token;
-		std::promise<void> m_thread_result;
-		std::mutex m_mutex;
-		ForwardedCallQueue m_call_queue;
+			notifyCall();
+		}
 
-		template<class... Args>
-		class OpCaller
+	private:
+		// bounded multi-producer single-consumer ring of calls, small arguments are stored inline
+		// producers that must not wait spill the calls that don't fit to a locked overflow list
+		class CallQueue
 		{
-			template<class U>
-			static auto test(bool) -> decltype(std::declval<U>()(std::declval<Args>()...), void(), std::true_type{})
+		public:
+			CallQueue(size_t capacity, IMemoryPool* memory) :
+				m_memory(memory),
+				m_capacity(1),
+				m_cells(nullptr),
+				m_head(0),
+				m_tail(0),
+				m_spilled(false),
+				m_overflow_head(nullptr),
+				m_overflow_tail(nullptr),
+				m_batch(nullptr)
 			{
-				return {};
-			}
+				while (m_capacity < capacity)
+					m_capacity <<= 1;
 
-			template<class U>
-			static auto test(int) -> std::false_type
-			{
-				return {};
+				raz::Allocator<Cell> alloc(memory);
+				m_cells = alloc.allocate(m_capacity);
+				for (size_t i = 0; i < m_capacity; ++i)
+					new (&m_cells[i]) Cell(i);
 			}
 
-			static constexpr bool has_parenthesis_op = decltype(test<T>(true))::value;
+			CallQueue(const CallQueue&) = delete;
 
-			template<bool value>
-			static std::enable_if_t<value, bool> _call(T& object, Args&&... args)
+			~CallQueue()
 			{
-				object(std::forward<Args>(args)...);
-				return true;
+				clear();
+
+				raz::Allocator<Cell> alloc(m_memory);
+				for (size_t i = 0; i < m_capacity; ++i)
+					m_cells[i].~Cell();
+				alloc.deallocate(m_cells, m_capacity);
 			}
 
-			template<int value>
-			static std::enable_if_t<!value, bool> _call(T& object, Args&&... args)
+			CallQueue& operator=(const CallQueue&) = delete;
+
+			// returns false if the queue is full, unless the call 'may_spill'
+			template<class... Args>
+			bool push(bool may_spill, Args&&... args)
 			{
-				return false;
+				return emplace<std::tuple<std::decay_t<Args>...>>(may_spill, std::forward<Args>(args)...);
 			}
 
-		public:
-			static bool call(T& object, Args&&... args)
+			template<class F>
+			bool post(bool may_spill, F&& fn)
 			{
-				return _call<has_parenthesis_op>(object, std::forward<Args>(args)...);
+				return emplace<PostedCall<std::decay_t<F>>>(may_spill, std::forward<F>(fn));
 			}
-		};
 
-		template<class... Args>
-		void run(Args&&... args)
-		{
-			try
+			// consumer thread only, returns false if the queue is empty
+			bool pop(T* object)
 			{
-				T object(std::forward<Args>(args)...);
+				// spilled calls come after the ones already in the ring, so they are only taken when the ring is empty
+				if (!m_batch && !ringReady() && m_spilled.load())
+					takeOverflow();
 
-				std::future<void> exit_token = m_exit_token.get_future();
-				ForwardedCallQueue call_queue(m_memory);
+				if (m_batch)
+					return popOverflow(object);
 
-				for (;;)
+				Cell& cell = m_cells[m_head & (m_capacity - 1)];
+				if (cell.sequence.load(std::memory_order_seq_cst) != m_head + 1)
+					return false;
+
+				// the cell is released even if the call throws
+				struct Release
 				{
-					m_mutex.lock();
-					std::swap(m_call_queue, call_queue);
-					m_mutex.unlock();
+					Cell& cell;
+					size_t sequence;
 
-					for (auto& call : call_queue)
+					~Release()
 					{
-						try
-						{
-							call(object);
-						}
-						catch (ThreadStop)
-						{
-							m_thread_result.set_value();
-							return;
-						}
-						catch (std::exception& e)
-						{
-							if (!OpCaller<std::exception&>::call(object, e) && !OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
-						}
-						catch (...)
-						{
-							if (!OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
-						}
+						if (cell.destroy)
+							cell.destroy(cell.storage, cell.memory);
+
+						cell.sequence.store(sequence, std::memory_order_release);
 					}
+				} release = { cell, m_head + m_capacity };
 
-					call_queue.clear();
+				++m_head;
 
-					try
-					{
-						OpCaller<>::call(object);
-					}
-					catch (ThreadStop)
-					{
-						m_thread_result.set_value();
-						return;
-					}
-					catch (std::exception& e)
-					{
-						if (!OpCaller<std::exception&>::call(object, e) && !OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
-					}
-					catch (...)
-					{
-						if (!OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
-					}
+				if (cell.invoke && object)
+					cell.invoke(cell.storage, *object);
 
-					auto exit_status = exit_token.wait_for(std::chrono::milliseconds(1));
-					if (exit_status == std::future_status::ready)
-					{
-						m_thread_result.set_value();
-						return;
-					}
-				}
+				return true;
 			}
-			catch (...)
+
+			bool empty() const
 			{
-				m_thread_result.set_exception(std::current_exception());
+				return (!m_batch && !ringReady() && !m_spilled.load());
 			}
-		}
-	};
 
-	class TaskManager
-	{
-	public:
-		TaskManager(size_t threads = 0, IMemoryPool* memory = nullptr) :
-			m_threads(memory),
-			m_tasklist(memory),
-			m_exit_token(std::allocator_arg, raz::Allocator<int>(memory))
-		{
-			if (threads == 0)
+			// consumer thread only
+			void clear()
 			{
-				threads = std::thread::hardware_concurrency();
-				if (threads == 0)
-				{
-					threads = 1;
-				}
+				while (pop(nullptr))
+					;
 			}
 
-			std::shared_future<void> exit_token_future = m_exit_token.get_future();
+			size_t capacity() const
+			{
+				return m_capacity;
+			}
 
-			m_threads.reserve(threads);
-			for (size_t i = 0; i < threads; ++i)
-				m_threads.push_back(std::thread(&TaskManager::run, this, exit_token_future));
-		}
+		private:
+			enum : size_t { INLINE_SIZE = 96 };
 
+			// 128 bytes per cell, so producers writing neighbouring cells rarely share a cache line
+			struct Cell
+			{
+				Cell(size_t sequence) :
+					sequence(sequence), invoke(nullptr), destroy(nullptr), memory(nullptr)
+				{
+				}
+
+				std::atomic<size_t> sequence;
+				void(*invoke)(void* storage, T& object);
+				void(*destroy)(void* storage, IMemoryPool* memory);
+				IMemoryPool* memory;
+				alignas(std::max_align_t) char storage[INLINE_SIZE];
+			};
+
+			template<class F>
+			struct PostedCall
+			{
+				template<class FArg>
+				PostedCall(FArg&& fn) :
+					fn(std::forward<FArg>(fn))
+				{
+				}
+
+				F fn;
+			};
+
+			struct OverflowNode
+			{
+				OverflowNode() :
+					cell(0), next(nullptr)
+				{
+				}
+
+				Cell cell;
+				OverflowNode* next;
+			};
+
+			IMemoryPool* m_memory;
+			size_t m_capacity;
+			Cell* m_cells;
+			size_t m_head; // consumer only
+			std::atomic<size_t> m_tail;
+			std::atomic<bool> m_spilled; // the overflow list isn't empty
+			std::mutex m_overflow_mutex;
+			OverflowNode* m_overflow_head;
+			OverflowNode* m_overflow_tail;
+			OverflowNode* m_batch; // taken from the overflow list, consumer only
+
+			bool ringReady() const
+			{
+				return (m_cells[m_head & (m_capacity - 1)].sequence.load(std::memory_order_seq_cst) == m_head + 1);
+			}
+
+			template<class Arguments, class... Args>
+			bool emplace(bool may_spill, Args&&... args)
+			{
+				// while there are spilled calls, the ones that may spill go after them to keep their order
+				// the arguments are only forwarded once a slot is claimed, so they are still intact if the ring is full
+				if (!(may_spill && m_spilled.load()) && tryEmplace<Arguments>(std::forward<Args>(args)...))
+					return true;
+
+				if (!may_spill)
+					return false;
+
+				spill<Arguments>(std::forward<Args>(args)...);
+				return true;
+			}
+
+			template<class Arguments, class... Args>
+			void spill(Args&&... args)
+			{
+				raz::Allocator<OverflowNode> alloc(m_memory);
+				OverflowNode* node = alloc.allocate(1);
+				new (node) OverflowNode();
+
+				try
+				{
+					construct<Arguments>(&node->cell, std::integral_constant<bool, (sizeof(Arguments) <= INLINE_SIZE && alignof(Arguments) <= alignof(std::max_align_t))>(), std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					node->~OverflowNode();
+					alloc.deallocate(node, 1);
+					throw;
+				}
+
+				std::lock_guard<std::mutex> guard(m_overflow_mutex);
+				if (m_overflow_tail)
+					m_overflow_tail->next = node;
+				else
+					m_overflow_head = node;
+
+				m_overflow_tail = node;
+				m_spilled = true;
+			}
+
+			void takeOverflow()
+			{
+				std::lock_guard<std::mutex> guard(m_overflow_mutex);
+				m_batch = m_overflow_head;
+				m_overflow_head = nullptr;
+				m_overflow_tail = nullptr;
+				m_spilled = false;
+			}
+
+			bool popOverflow(T* object)
+			{
+				OverflowNode* node = m_batch;
+				m_batch = node->next;
+
+				// the node is freed even if the call throws
+				struct Release
+				{
+					IMemoryPool* memory;
+					OverflowNode* node;
+
+					~Release()
+					{
+						if (node->cell.destroy)
+							node->cell.destroy(node->cell.storage, node->cell.memory);
+
+						raz::Allocator<OverflowNode> alloc(memory);
+						node->~OverflowNode();
+						alloc.deallocate(node, 1);
+					}
+				} release = { m_memory, node };
+
+				if (node->cell.invoke && object)
+					node->cell.invoke(node->cell.storage, *object);
+
+				return true;
+			}
+
+			template<class Arguments, class... Args>
+			bool tryEmplace(Args&&... args)
+			{
+				size_t pos = m_tail.load(std::memory_order_relaxed);
+				Cell* cell;
+
+				for (;;)
+				{
+					cell = &m_cells[pos & (m_capacity - 1)];
+					const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+					const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+
+					if (diff == 0)
+					{
+						if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (diff < 0)
+					{
+						return false;
+					}
+					else
+					{
+						pos = m_tail.load(std::memory_order_relaxed);
+					}
+				}
+
+				try
+				{
+					construct<Arguments>(cell, std::integral_constant<bool, (sizeof(Arguments) <= INLINE_SIZE && alignof(Arguments) <= alignof(std::max_align_t))>(), std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					// the slot is already claimed, so it's published as a call that does nothing
+					cell->invoke = nullptr;
+					cell->destroy = nullptr;
+					cell->sequence.store(pos + 1, std::memory_order_seq_cst);
+					throw;
+				}
+
+				cell->sequence.store(pos + 1, std::memory_order_seq_cst);
+				return true;
+			}
+
+			// arguments that fit are stored in the cell
+			template<class Arguments, class... Args>
+			void construct(Cell* cell, std::true_type, Args&&... args)
+			{
+				new (cell->storage) Arguments(std::forward<Args>(args)...);
+				cell->invoke = &invokeInline<Arguments>;
+				cell->destroy = &destroyInline<Arguments>;
+			}
+
+			// others are allocated from the memory pool
+			template<class Arguments, class... Args>
+			void construct(Cell* cell, std::false_type, Args&&... args)
+			{
+				raz::Allocator<Arguments> alloc(m_memory);
+				Arguments* arguments = alloc.allocate(1);
+
+				try
+				{
+					new (arguments) Arguments(std::forward<Args>(args)...);
+				}
+				catch (...)
+				{
+					alloc.deallocate(arguments, 1);
+					throw;
+				}
+
+				std::memcpy(cell->storage, &arguments, sizeof(Arguments*));
+				cell->memory = m_memory;
+				cell->invoke = &invokeIndirect<Arguments>;
+				cell->destroy = &destroyIndirect<Arguments>;
+			}
+
+			template<class Arguments, size_t... I>
+			static void invoke(Arguments& arguments, T& object, std::index_sequence<I...>)
+			{
+				object(std::move(std::get<I>(arguments))...);
+			}
+
+			template<class... Args>
+			static void call(std::tuple<Args...>& arguments, T& object)
+			{
+				invoke(arguments, object, std::index_sequence_for<Args...>());
+			}
+
+			template<class F>
+			static void call(PostedCall<F>& posted, T& object)
+			{
+				posted.fn(object);
+			}
+
+			template<class Arguments>
+			static void invokeInline(void* storage, T& object)
+			{
+				call(*static_cast<Arguments*>(storage), object);
+			}
+
+			template<class Arguments>
+			static void destroyInline(void* storage, IMemoryPool*)
+			{
+				static_cast<Arguments*>(storage)->~Arguments();
+			}
+
+			template<class Arguments>
+			static void invokeIndirect(void* storage, T& object)
+			{
+				Arguments* arguments;
+				std::memcpy(&arguments, storage, sizeof(Arguments*));
+				call(*arguments, object);
+			}
+
+			template<class Arguments>
+			static void destroyIndirect(void* storage, IMemoryPool* memory)
+			{
+				Arguments* arguments;
+				std::memcpy(&arguments, storage, sizeof(Arguments*));
+
+				raz::Allocator<Arguments> alloc(memory);
+				arguments->~Arguments();
+				alloc.deallocate(arguments, 1);
+			}
+		};
+
+		ThreadConfig m_config;
+		IMemoryPool* m_memory;
+		WakeupMode m_wakeup;
+		std::chrono::microseconds m_loop_interval;
+		bool m_unbounded;
+		std::atomic<std::thread::id> m_owner; // the running thread
+		NativeThread m_thread;
+		std::atomic<bool> m_stop;
+		std::atomic<bool> m_sleeping;
+		std::atomic<bool> m_clear;
+		std::promise<void> m_thread_result;
+		std::mutex m_mutex; // start & stop
+		std::mutex m_queue_mutex;
+		std::condition_variable m_queue_notifier;
+		CallQueue m_call_queue;
+		std::function<void(std::exception_ptr)> m_exit_hook; // set by ThreadGroup while the thread is stopped
+
+		friend class ThreadGroup<T>;
+
+		void finish(std::exception_ptr exception = nullptr)
+		{
+			if (exception)
+				m_thread_result.set_exception(exception);
+			else
+				m_thread_result.set_value();
+
+			if (m_exit_hook)
+				m_exit_hook(exception);
+		}
+
+		// the thread's own calls never wait for space, since only the thread itself could make space
+		bool canSpill() const
+		{
+			return (m_unbounded || m_owner.load() == std::this_thread::get_id());
+		}
+
+		void notifyCall()
+		{
+			if (m_sleeping.load())
+			{
+				std::lock_guard<std::mutex> guard(m_queue_mutex);
+				m_queue_notifier.notify_one();
+			}
+		}
+
+		void signalStop()
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_queue_mutex);
+				m_stop = true;
+			}
+
+			m_queue_notifier.notify_one();
+		}
+
+		// returns false if the thread should stop
+		bool waitForCalls(std::chrono::steady_clock::time_point next_loop, bool loop)
+		{
+			if (m_wakeup == SPIN_THEN_PARK)
+			{
+				const auto spin_until = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+				while (!m_stop && m_call_queue.empty())
+				{
+					const auto now = std::chrono::steady_clock::now();
+					if (now >= spin_until || (loop && now >= next_loop))
+						break;
+
+					std::this_thread::yield();
+				}
+			}
+
+			// producers only notify if they see m_sleeping set after publishing their call
+			std::unique_lock<std::mutex> lock(m_queue_mutex);
+			m_sleeping = true;
+			auto wakeup_condition = [this] { return (m_stop || !m_call_queue.empty()); };
+
+			if (loop)
+				m_queue_notifier.wait_until(lock, next_loop, wakeup_condition);
+			else
+				m_queue_notifier.wait(lock, wakeup_condition);
+
+			m_sleeping = false;
+			return !m_stop;
+		}
+
+		template<class... Args>
+		class OpCaller
+		{
+			template<class U>
+			static auto test(bool) -> decltype(std::declval<U>()(std::declval<Args>()...), void(), std::true_type{})
+			{
+				return {};
+			}
+
+			template<class U>
+			static auto test(int) -> std::false_type
+			{
+				return {};
+			}
+
+		public:
+			static constexpr bool has_parenthesis_op = decltype(test<T>(true))::value;
+
+		private:
+			template<bool value>
+			static std::enable_if_t<value, bool> _call(T& object, Args&&... args)
+			{
+				object(std::forward<Args>(args)...);
+				return true;
+			}
+
+			template<int value>
+			static std::enable_if_t<!value, bool> _call(T&, Args&&...)
+			{
+				return false;
+			}
+
+		public:
+			static bool call(T& object, Args&&... args)
+			{
+				return _call<has_parenthesis_op>(object, std::forward<Args>(args)...);
+			}
+		};
+
+		template<class... Args>
+		void run(Args&&... args)
+		{
+			struct Owner
+			{
+				std::atomic<std::thread::id>& owner;
+
+				~Owner()
+				{
+					owner = std::thread::id();
+				}
+			} owner = { m_owner };
+
+			m_owner = std::this_thread::get_id();
+
+			try
+			{
+				T object(std::forward<Args>(args)...);
+
+				auto next_loop = std::chrono::steady_clock::now();
+
+				for (;;)
+				{
+					if (m_clear.exchange(false))
+						m_call_queue.clear();
+
+					// at most one queue's worth of calls before the object is ticked again
+					for (size_t i = 0; i < m_call_queue.capacity(); ++i)
+					{
+						try
+						{
+							if (!m_call_queue.pop(&object))
+								break;
+						}
+						catch (ThreadStop)
+						{
+							finish();
+							return;
+						}
+						catch (std::exception& e)
+						{
+							if (!OpCaller<std::exception&>::call(object, e) && !OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
+						}
+						catch (...)
+						{
+							if (!OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
+						}
+					}
+
+					const auto now = std::chrono::steady_clock::now();
+					if (OpCaller<>::has_parenthesis_op && now >= next_loop)
+					{
+						next_loop = now + m_loop_interval;
+
+						try
+						{
+							OpCaller<>::call(object);
+						}
+						catch (ThreadStop)
+						{
+							finish();
+							return;
+						}
+						catch (std::exception& e)
+						{
+							if (!OpCaller<std::exception&>::call(object, e) && !OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
+						}
+						catch (...)
+						{
+							if (!OpCaller<std::exception_ptr>::call(object, std::current_exception())) throw;
+						}
+					}
+
+					if (!waitForCalls(next_loop, OpCaller<>::has_parenthesis_op))
+					{
+						finish();
+						return;
+					}
+				}
+			}
+			catch (...)
+			{
+				finish(std::current_exception());
+			}
+		}
+	};
+
+	// N threads running one T object each, calls with the same key always go to the same thread in order
+	template<class T>
+	class ThreadGroup
+	{
+	public:
+		// the threads are named "<config.name>-<index>" if config.name is set
+		ThreadGroup(size_t count, const ThreadConfig& config = ThreadConfig(), IMemoryPool* memory = nullptr, WakeupMode wakeup = PARK,
+			std::chrono::microseconds loop_interval = std::chrono::milliseconds(1), size_t queue_capacity = 1024)
+		{
+			if (count == 0)
+				throw std::invalid_argument("ThreadGroup needs at least one thread");
+
+			m_threads.reserve(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				ThreadConfig thread_config = config;
+				if (!config.name.empty())
+					thread_config.name += "-" + std::to_string(i);
+
+				m_threads.emplace_back(new Thread<T>(thread_config, memory, wakeup, loop_interval, queue_capacity));
+			}
+		}
+
+		ThreadGroup(const ThreadGroup&) = delete;
+
+		ThreadGroup& operator=(const ThreadGroup&) = delete;
+
+		~ThreadGroup()
+		{
+			stop();
+		}
+
+		// every thread constructs its object from a copy of 'args'
+		// the returned future is ready when all threads have exited, it holds the first exception thrown by any of them
+		template<class... Args>
+		std::future<void> start(const Args&... args)
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+
+			stopThreads();
+
+			auto result = std::make_shared<GroupResult>(m_threads.size());
+			for (auto& thread : m_threads)
+				thread->m_exit_hook = [result](std::exception_ptr exception) { result->exit(exception); };
+
+			std::future<void> future = result->promise.get_future();
+
+			for (size_t i = 0; i < m_threads.size(); ++i)
+			{
+				try
+				{
+					m_threads[i]->start(args...);
+				}
+				catch (...)
+				{
+					// the threads that could not start count as exited
+					for (size_t j = i; j < m_threads.size(); ++j)
+						result->exit(std::current_exception());
+
+					throw;
+				}
+			}
+
+			return future;
+		}
+
+		// signals every thread first, so they shut down in parallel
+		void stop()
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			stopThreads();
+		}
+
+		// the threads stop after their current call, the future returned by start() tells when they are done
+		void requestStop()
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			signalThreads();
+		}
+
+		void clear()
+		{
+			for (auto& thread : m_threads)
+				thread->clear();
+		}
+
+		// the call runs on the thread that owns 'key'
+		template<class Key, class... Args>
+		void call(const Key& key, Args&&... args)
+		{
+			(*m_threads[getIndex(key)])(std::forward<Args>(args)...);
+		}
+
+		// fn(object) runs on the thread that owns 'key'
+		template<class Key, class F>
+		void post(const Key& key, F fn)
+		{
+			m_threads[getIndex(key)]->post(std::move(fn));
+		}
+
+		// every thread receives a copy of the arguments
+		template<class... Args>
+		void broadcast(const Args&... args)
+		{
+			for (auto& thread : m_threads)
+				(*thread)(args...);
+		}
+
+		// fn(object) runs on every thread, fn is copied
+		template<class F>
+		void broadcastPost(const F& fn)
+		{
+			for (auto& thread : m_threads)
+				thread->post(fn);
+		}
+
+		template<class Key>
+		size_t getIndex(const Key& key) const
+		{
+			return static_cast<size_t>(mix(hashKey(key)) % m_threads.size());
+		}
+
+		Thread<T>& operator[](size_t index)
+		{
+			return *m_threads[index];
+		}
+
+		size_t size() const
+		{
+			return m_threads.size();
+		}
+
+	private:
+		struct GroupResult
+		{
+			std::promise<void> promise;
+			std::atomic<size_t> running;
+			std::exception_ptr exception; // the first one
+			std::mutex mutex;
+
+			GroupResult(size_t threads) :
+				running(threads)
+			{
+			}
+
+			void exit(std::exception_ptr thread_exception)
+			{
+				if (thread_exception)
+				{
+					std::lock_guard<std::mutex> guard(mutex);
+					if (!exception)
+						exception = thread_exception;
+				}
+
+				if (running.fetch_sub(1) == 1)
+				{
+					std::lock_guard<std::mutex> guard(mutex);
+					if (exception)
+						promise.set_exception(exception);
+					else
+						promise.set_value();
+				}
+			}
+		};
+
+		std::vector<std::unique_ptr<Thread<T>>> m_threads;
+		std::mutex m_mutex; // start & stop
+
+		void signalThreads()
+		{
+			for (auto& thread : m_threads)
+			{
+				if (thread->m_thread.joinable())
+					thread->signalStop();
+			}
+		}
+
+		void stopThreads()
+		{
+			signalThreads();
+
+			for (auto& thread : m_threads)
+			{
+				thread->stop();
+				thread->m_exit_hook = nullptr;
+			}
+		}
+
+		static uint64_t hashKey(const char* key)
+		{
+			return raz::hash(key);
+		}
+
+		static uint64_t hashKey(const std::string& key)
+		{
+			return raz::hash(key.c_str());
+		}
+
+		template<class Key>
+		static uint64_t hashKey(const Key& key)
+		{
+			return static_cast<uint64_t>(std::hash<Key>()(key));
+		}
+
+		// std::hash of integers is usually the identity, so the bits are mixed before the modulo (splitmix64 finalizer)
+		static uint64_t mix(uint64_t h)
+		{
+			h ^= h >> 30;
+			h *= 0xbf58476d1ce4e5b9ull;
+			h ^= h >> 27;
+			h *= 0x94d049bb133111ebull;
+			h ^= h >> 31;
+			return h;
+		}
+	};
+
+	// Chase-Lev deque: the owner thread pushes and pops at the bottom, other threads steal from the top
+	template<class T>
+	class WorkStealingDeque
+	{
+	public:
+		WorkStealingDeque(size_t capacity = 256) :
+			m_top(0),
+			m_bottom(0)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+
+			m_arrays.emplace_back(new Array(size));
+			m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+		}
+
+		WorkStealingDeque(const WorkStealingDeque&) = delete;
+
+		WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+		// owner thread only
+		void push(T* item)
+		{
+			const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			const int64_t top = m_top.load(std::memory_order_acquire);
+			Array* array = m_array.load(std::memory_order_relaxed);
+
+			if (bottom - top >= static_cast<int64_t>(array->size))
+				array = grow(array, top, bottom);
+
+			array->put(bottom, item);
+			m_bottom.store(bottom + 1, std::memory_order_release);
+		}
+
+		// owner thread only, returns nullptr if the deque is empty
+		T* pop()
+		{
+			const int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+			Array* array = m_array.load(std::memory_order_relaxed);
+			m_bottom.store(bottom, std::memory_order_seq_cst);
+			int64_t top = m_top.load(std::memory_order_seq_cst);
+
+			if (top > bottom)
+			{
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			T* item = array->get(bottom);
+			if (top == bottom)
+			{
+				// last item, race against the thieves
+				if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					item = nullptr;
+
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+			return item;
+		}
+
+		// any thread, returns nullptr if the deque is empty or another thread got the item first
+		T* steal()
+		{
+			int64_t top = m_top.load(std::memory_order_seq_cst);
+			const int64_t bottom = m_bottom.load(std::memory_order_seq_cst);
+
+			if (top >= bottom)
+				return nullptr;
+
+			Array* array = m_array.load(std::memory_order_acquire);
+			T* item = array->get(top);
+			if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+
+			return item;
+		}
+
+		// approximate if other threads are using the deque
+		size_t size() const
+		{
+			const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+			const int64_t top = m_top.load(std::memory_order_relaxed);
+			return (bottom > top) ? static_cast<size_t>(bottom - top) : 0;
+		}
+
+	private:
+		struct Array
+		{
+			Array(size_t size) :
+				size(size),
+				items(new std::atomic<T*>[size])
+			{
+			}
+
+			T* get(int64_t i) const
+			{
+				return items[static_cast<size_t>(i) & (size - 1)].load(std::memory_order_relaxed);
+			}
+
+			void put(int64_t i, T* item)
+			{
+				items[static_cast<size_t>(i) & (size - 1)].store(item, std::memory_order_relaxed);
+			}
+
+			size_t size;
+			std::unique_ptr<std::atomic<T*>[]> items;
+		};
+
+		std::atomic<int64_t> m_top;
+		std::atomic<int64_t> m_bottom;
+		std::atomic<Array*> m_array;
+		std::vector<std::unique_ptr<Array>> m_arrays; // thieves might still read the old arrays, so they are kept
+
+		Array* grow(Array* array, int64_t top, int64_t bottom)
+		{
+			m_arrays.emplace_back(new Array(array->size * 2));
+			Array* new_array = m_arrays.back().get();
+
+			for (int64_t i = top; i < bottom; ++i)
+				new_array->put(i, array->get(i));
+
+			m_array.store(new_array, std::memory_order_release);
+			return new_array;
+		}
+	};
+
+	class TaskManager;
+
+	// shared state of a Promise and its Futures
+	class FutureStateBase
+	{
+	public:
+		// called once the state becomes ready (must not throw)
+		class Continuation
+		{
+		public:
+			virtual ~Continuation() = default;
+			virtual void run() = 0;
+
+		private:
+			Continuation* m_next = nullptr;
+
+			friend class FutureStateBase;
+		};
+
+		FutureStateBase(IMemoryPool* memory, TaskManager* executor) :
+			m_memory(memory),
+			m_executor(executor),
+			m_refs(1),
+			m_ready(false),
+			m_continuations(nullptr)
+		{
+		}
+
+		FutureStateBase(const FutureStateBase&) = delete;
+
+		FutureStateBase& operator=(const FutureStateBase&) = delete;
+
+		void addRef()
+		{
+			m_refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void release()
+		{
+			if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				destroy();
+		}
+
+		bool isReady() const
+		{
+			return m_ready.load(std::memory_order_acquire);
+		}
+
+		// runs a deferred task on the calling thread if it hasn't started yet,
+		// TaskManager workers run other tasks while they wait
+		void wait();
+
+		template<class Clock, class Duration>
+		bool waitUntil(const std::chrono::time_point<Clock, Duration>& time) const
+		{
+			if (isReady())
+				return true;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			return m_notifier.wait_until(lock, time, [this] { return isReady(); });
+		}
+
+		void setException(std::exception_ptr exception)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			checkNotReady();
+			m_exception = exception;
+			makeReady(lock);
+		}
+
+		// runs the continuation right away if the state is already ready
+		void addContinuation(Continuation* continuation)
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+
+				if (!isReady())
+				{
+					Continuation** tail = &m_continuations;
+					while (*tail)
+						tail = &(*tail)->m_next;
+
+					*tail = continuation;
+					return;
+				}
+			}
+
+			continuation->run();
+		}
+
+		IMemoryPool* getMemoryPool() const
+		{
+			return m_memory;
+		}
+
+		// continuations are scheduled on this TaskManager (if set)
+		TaskManager* getExecutor() const
+		{
+			return m_executor;
+		}
+
+	protected:
+		mutable std::mutex m_mutex;
+
+		virtual ~FutureStateBase() = default;
+		virtual void destroy() = 0;
+
+		// states that belong to a task run it if nobody else has started it yet
+		virtual void runInline()
+		{
+		}
+
+		void checkNotReady() const
+		{
+			if (isReady())
+				throw std::future_error(std::future_errc::promise_already_satisfied);
+		}
+
+		void rethrowException() const
+		{
+			if (m_exception)
+				std::rethrow_exception(m_exception);
+		}
+
+		// 'lock' must own m_mutex
+		void makeReady(std::unique_lock<std::mutex>& lock)
+		{
+			Continuation* continuation = m_continuations;
+			m_continuations = nullptr;
+			m_ready.store(true, std::memory_order_release);
+			lock.unlock();
+			m_notifier.notify_all();
+
+			while (continuation)
+			{
+				Continuation* next = continuation->m_next;
+				continuation->run();
+				continuation = next;
+			}
+		}
+
+	private:
+		IMemoryPool* m_memory;
+		TaskManager* m_executor;
+		std::atomic<size_t> m_refs;
+		std::atomic<bool> m_ready;
+		mutable std::condition_variable m_notifier;
+		std::exception_ptr m_exception;
+		Continuation* m_continuations;
+	};
+
+	template<class R>
+	class FutureState : public FutureStateBase
+	{
+		static_assert(!std::is_reference<R>::value, "Futures of references are not supported");
+
+	public:
+		static FutureState* create(IMemoryPool* memory, TaskManager* executor)
+		{
+			raz::Allocator<FutureState> alloc(memory);
+			FutureState* state = alloc.allocate(1);
+			new (state) FutureState(memory, executor);
+			return state;
+		}
+
+		FutureState(IMemoryPool* memory, TaskManager* executor) :
+			FutureStateBase(memory, executor),
+			m_has_value(false)
+		{
+		}
+
+		template<class... Args>
+		void setValue(Args&&... args)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			checkNotReady();
+			new (&m_value) R(std::forward<Args>(args)...);
+			m_has_value = true;
+			makeReady(lock);
+		}
+
+		// sets the value returned by 'fn' or the exception it throws
+		template<class F>
+		void setResult(F&& fn)
+		{
+			try
+			{
+				setValue(fn());
+			}
+			catch (...)
+			{
+				setException(std::current_exception());
+			}
+		}
+
+		const R& get()
+		{
+			wait();
+			rethrowException();
+			return *reinterpret_cast<const R*>(&m_value);
+		}
+
+	protected:
+		~FutureState()
+		{
+			if (m_has_value)
+				reinterpret_cast<R*>(&m_value)->~R();
+		}
+
+		virtual void destroy()
+		{
+			raz::Allocator<FutureState> alloc(getMemoryPool());
+			this->~FutureState();
+			alloc.deallocate(this, 1);
+		}
+
+	private:
+		typename std::aligned_storage<sizeof(R), alignof(R)>::type m_value;
+		bool m_has_value;
+	};
+
+	template<>
+	class FutureState<void> : public FutureStateBase
+	{
+	public:
+		static FutureState* create(IMemoryPool* memory, TaskManager* executor)
+		{
+			raz::Allocator<FutureState> alloc(memory);
+			FutureState* state = alloc.allocate(1);
+			new (state) FutureState(memory, executor);
+			return state;
+		}
+
+		FutureState(IMemoryPool* memory, TaskManager* executor) :
+			FutureStateBase(memory, executor)
+		{
+		}
+
+		void setValue()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			checkNotReady();
+			makeReady(lock);
+		}
+
+		template<class F>
+		void setResult(F&& fn)
+		{
+			try
+			{
+				fn();
+			}
+			catch (...)
+			{
+				setException(std::current_exception());
+				return;
+			}
+
+			setValue();
+		}
+
+		void get()
+		{
+			wait();
+			rethrowException();
+		}
+
+	protected:
+		~FutureState() = default;
+
+		virtual void destroy()
+		{
+			raz::Allocator<FutureState> alloc(getMemoryPool());
+			this->~FutureState();
+			alloc.deallocate(this, 1);
+		}
+	};
+
+	// calls fn(value) or fn() for void futures
+	template<class R>
+	struct FutureValueCall
+	{
+		template<class F, class FutureType>
+		static auto call(F& fn, const FutureType& future) -> decltype(fn(std::declval<const R&>()))
+		{
+			return fn(future.get());
+		}
+	};
+
+	template<>
+	struct FutureValueCall<void>
+	{
+		template<class F, class FutureType>
+		static auto call(F& fn, const FutureType& future) -> decltype(fn())
+		{
+			future.get();
+			return fn();
+		}
+	};
+
+	// like std::shared_future, but with continuations
+	template<class R>
+	class Future
+	{
+	public:
+		template<class F>
+		using ThenResult = decltype(FutureValueCall<R>::call(std::declval<F&>(), std::declval<const Future<R>&>()));
+
+		Future() :
+			m_state(nullptr)
+		{
+		}
+
+		// takes over a reference of 'state'
+		explicit Future(FutureState<R>* state) :
+			m_state(state)
+		{
+		}
+
+		Future(const Future& other) :
+			m_state(other.m_state)
+		{
+			if (m_state)
+				m_state->addRef();
+		}
+
+		Future(Future&& other) :
+			m_state(other.m_state)
+		{
+			other.m_state = nullptr;
+		}
+
+		~Future()
+		{
+			if (m_state)
+				m_state->release();
+		}
+
+		Future& operator=(Future other)
+		{
+			std::swap(m_state, other.m_state);
+			return *this;
+		}
+
+		bool valid() const
+		{
+			return (m_state != nullptr);
+		}
+
+		bool isReady() const
+		{
+			return m_state->isReady();
+		}
+
+		// returns a const reference to the value (or nothing for void), throws the stored exception
+		decltype(auto) get() const
+		{
+			return m_state->get();
+		}
+
+		void wait() const
+		{
+			m_state->wait();
+		}
+
+		template<class Rep, class Period>
+		std::future_status wait_for(const std::chrono::duration<Rep, Period>& duration) const
+		{
+			return wait_until(std::chrono::steady_clock::now() + duration);
+		}
+
+		template<class Clock, class Duration>
+		std::future_status wait_until(const std::chrono::time_point<Clock, Duration>& time) const
+		{
+			return (m_state->waitUntil(time) ? std::future_status::ready : std::future_status::timeout);
+		}
+
+		// fn(future) is called on the thread that makes the future ready, or right away if it's ready already
+		template<class F>
+		void onReady(F fn) const
+		{
+			raz::Allocator<Callback<F>> alloc(m_state->getMemoryPool());
+			Callback<F>* callback = alloc.allocate(1);
+			new (callback) Callback<F>(*this, std::move(fn));
+			m_state->addContinuation(callback);
+		}
+
+		// fn(value) (or fn() for void) runs on the TaskManager of this future, or inline if there is none
+		// exceptions are passed on to the returned future without calling fn
+		template<class F>
+		auto then(F fn) const -> Future<ThenResult<F>>;
+
+		IMemoryPool* getMemoryPool() const
+		{
+			return m_state->getMemoryPool();
+		}
+
+		TaskManager* getExecutor() const
+		{
+			return m_state->getExecutor();
+		}
+
+		// for code written against the std::shared_future that TaskManager used to return
+		// like those, the result is deferred: it waits for this future (or runs its task) when it's waited on
+		operator std::shared_future<R>() const
+		{
+			Future future(*this);
+			return std::async(std::launch::deferred, [future]() -> R { return future.get(); }).share();
+		}
+
+	private:
+		template<class F>
+		class Callback : public FutureStateBase::Continuation
+		{
+		public:
+			Callback(const Future& future, F&& fn) :
+				m_future(future), m_fn(std::move(fn))
+			{
+			}
+
+			virtual void run()
+			{
+				m_fn(m_future);
+
+				raz::Allocator<Callback> alloc(m_future.getMemoryPool());
+				this->~Callback();
+				alloc.deallocate(this, 1);
+			}
+
+		private:
+			Future m_future;
+			F m_fn;
+		};
+
+		FutureState<R>* m_state;
+	};
+
+	template<class R>
+	class Promise
+	{
+	public:
+		Promise(IMemoryPool* memory = nullptr, TaskManager* executor = nullptr) :
+			m_state(FutureState<R>::create(memory, executor))
+		{
+		}
+
+		Promise(const Promise&) = delete;
+
+		Promise(Promise&& other) :
+			m_state(other.m_state)
+		{
+			other.m_state = nullptr;
+		}
+
+		// the future receives a broken_promise error if there is no value by now
+		~Promise()
+		{
+			if (m_state)
+			{
+				if (!m_state->isReady())
+					m_state->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+
+				m_state->release();
+			}
+		}
+
+		Promise& operator=(const Promise&) = delete;
+
+		Promise& operator=(Promise&& other)
+		{
+			Promise tmp(std::move(other));
+			std::swap(m_state, tmp.m_state);
+			return *this;
+		}
+
+		Future<R> getFuture()
+		{
+			m_state->addRef();
+			return Future<R>(m_state);
+		}
+
+		template<class... Args>
+		void setValue(Args&&... args)
+		{
+			m_state->setValue(std::forward<Args>(args)...);
+		}
+
+		void setException(std::exception_ptr exception)
+		{
+			m_state->setException(exception);
+		}
+
+		// sets the value returned by 'fn' or the exception it throws
+		template<class F>
+		void setResult(F&& fn)
+		{
+			m_state->setResult(std::forward<F>(fn));
+		}
+
+	private:
+		FutureState<R>* m_state;
+	};
+
+	enum TaskPriority
+	{
+		HIGH,
+		NORMAL,
+		BACKGROUND
+	};
+
+	enum OverflowPolicy
+	{
+		BLOCK,     // the caller waits until there is space in the queue (callers on a worker thread run the task instead)
+		REJECT,    // TaskRejectedError is thrown
+		RUN_INLINE // the caller runs the task
+	};
+
+	class TaskRejectedError : public std::runtime_error
+	{
+	public:
+		TaskRejectedError(const char* reason) :
+			std::runtime_error(reason)
+		{
+		}
+	};
+
+	struct WorkerStats
+	{
+		// latency[0] counts the tasks that started within 1us after they were queued,
+		// latency[i] counts [2^(i-1), 2^i) microseconds, the last bucket counts everything longer
+		enum : size_t { BUCKETS = 24 };
+
+		uint64_t tasks_executed = 0;
+		uint64_t busy_time_ns = 0; // nested tasks (run while waiting for a future) aren't counted twice
+		uint64_t idle_time_ns = 0;
+		uint64_t steal_attempts = 0;
+		uint64_t steals = 0;
+		uint64_t queue_depth = 0; // tasks in the worker's own queue
+		uint64_t latency[BUCKETS] = {};
+
+		template<class Serializer>
+		void operator()(Serializer& serializer)
+		{
+			serializer(tasks_executed)(busy_time_ns)(idle_time_ns)(steal_attempts)(steals)(queue_depth);
+
+			for (auto& count : latency)
+				serializer(count);
+		}
+	};
+
+	struct TaskTrace
+	{
+		size_t worker;
+		TaskPriority priority;
+		std::chrono::steady_clock::time_point queued;
+		std::chrono::steady_clock::time_point started;
+		std::chrono::steady_clock::time_point finished;
+	};
+
+	struct TaskManagerConfig
+	{
+		size_t threads = 0; // 0 means one per hardware thread, or one per CPU of the topology layout
+		IMemoryPool* memory = nullptr;
+		WakeupMode wakeup = PARK;
+		std::string name = "raz-worker"; // workers are named "<name>-<index>"
+		size_t stack_size = 0;
+		std::vector<std::vector<unsigned>> cpus; // worker i is pinned to cpus[i % cpus.size()]
+		bool topology_layout = false; // fills 'cpus' with getTopologyLayout() if it's empty
+		size_t workers_per_node = 0;
+
+		size_t queue_capacity = 0; // 0 means unbounded
+		OverflowPolicy overflow_policy = BLOCK;
+
+		// instrumentation is off by default, because it reads the clock for every task
+		bool collect_stats = false;
+		std::function<void(const TaskTrace&)> trace_hook; // called by the workers, e.g. std::ref(chrome_trace)
+		size_t trace_sample_interval = 1; // every n-th task of a worker is traced
+	};
+
+	class TaskManager
+	{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		enum : size_t
+		{
+			PRIORITY_LEVELS = BACKGROUND + 1,
+			STARVATION_LIMIT = 8 // a priority level is served after it was passed over this many times
+		};
+
+		TaskManager(size_t threads = 0, IMemoryPool* memory = nullptr, WakeupMode wakeup = PARK) :
+			TaskManager(makeConfig(threads, memory, wakeup))
+		{
+		}
+
+		TaskManager(TaskManagerConfig config) :
+			m_memory(config.memory),
+			m_wakeup(config.wakeup),
+			m_collect_stats(config.collect_stats),
+			m_trace_hook(std::move(config.trace_hook)),
+			m_trace_sample_interval((config.trace_sample_interval > 0) ? config.trace_sample_interval : 1),
+			m_queue_capacity(config.queue_capacity),
+			m_overflow_policy(config.overflow_policy),
+			m_admitted_tasks(0),
+			m_blocked_producers(0),
+			m_unfinished_tasks(0),
+			m_drain_waiters(0),
+			m_shutdown(false),
+			m_threads(config.memory),
+			m_deadline_tasks(0),
+			m_queued_tasks(0),
+			m_shared_tasks(0),
+			m_sleeping_workers(0),
+			m_exit(false)
+		{
+			for (auto& queue : m_queues)
+				queue.deadlines = DeadlineHeap(m_memory);
+
+			for (auto& depth : m_queue_depth)
+				depth = 0;
+
+			if (config.topology_layout && config.cpus.empty())
+				config.cpus = getTopologyLayout(config.workers_per_node);
+
+			size_t threads = config.threads;
+			if (threads == 0)
+				threads = config.cpus.size();
+
+			if (threads == 0)
+			{
+				threads = std::thread::hardware_concurrency();
+				if (threads == 0)
+				{
+					threads = 1;
+				}
+			}
+
+			m_workers.reserve(threads);
+			for (size_t i = 0; i < threads; ++i)
+				m_workers.emplace_back(new Worker());
+
+			m_threads.reserve(threads);
+			for (size_t i = 0; i < threads; ++i)
+			{
+				ThreadConfig thread_config;
+				if (!config.name.empty())
+					thread_config.name = config.name + "-" + std::to_string(i);
+				if (!config.cpus.empty())
+					thread_config.cpus = config.cpus[i % config.cpus.size()];
+				thread_config.stack_size = config.stack_size;
+
+				m_threads.push_back(NativeThread(thread_config, &TaskManager::run, this, i));
+			}
+		}
+
+		// queued tasks are dropped, use shutdown() first to run them
 		~TaskManager()
 		{
-			m_mutex.lock();
-			m_notifier.notify_all();
-			m_mutex.unlock();
+			shutdown(false);
+		}
+
+		TaskManager(const TaskManager&) = delete;
+
+		TaskManager& operator=(const TaskManager&) = delete;
+
+		// the packed task runs when its future is waited for
+		template<class R, class C, class... fnArgs, class... Args>
+		static Future<R> pack(std::shared_ptr<C> obj, R(C::*fn)(fnArgs...), Args&&... args)
+		{
+			return pack([obj, fn](auto&&... args) -> R { return ((*obj).*fn)(std::forward<decltype(args)>(args)...); },
+				std::forward<Args>(args)...);
+		}
+
+		template<class C, class... Args>
+		static auto pack(std::shared_ptr<C> obj, Args&&... args) -> Future<decltype(obj->operator()(std::declval<std::decay_t<Args>>()...))>
+		{
+			return pack([obj](auto&&... args) { return obj->operator()(std::forward<decltype(args)>(args)...); },
+				std::forward<Args>(args)...);
+		}
+
+		template<class F, class... Args>
+		static auto pack(F fn, Args&&... args) -> Future<decltype(fn(std::declval<std::decay_t<Args>>()...))>
+		{
+			typedef decltype(fn(std::declval<std::decay_t<Args>>()...)) R;
+
+			// nothing else will hold a reference to the task, so the future takes over the initial one
+			return Future<R>(createTaskState<R>(nullptr, nullptr, std::move(fn), std::forward<Args>(args)...));
+		}
+
+		// tasks submitted from a worker thread go to the worker's own queue, others to the shared queue
+		template<class R, class C, class... fnArgs, class... Args>
+		Future<R> operator()(std::shared_ptr<C> obj, R(C::*fn)(fnArgs...), Args&&... args)
+		{
+			return (*this)([obj, fn](auto&&... args) -> R { return ((*obj).*fn)(std::forward<decltype(args)>(args)...); },
+				std::forward<Args>(args)...);
+		}
+
+		template<class C, class... Args>
+		auto operator()(std::shared_ptr<C> obj, Args&&... args) -> Future<decltype(obj->operator()(std::declval<std::decay_t<Args>>()...))>
+		{
+			return (*this)([obj](auto&&... args) { return obj->operator()(std::forward<decltype(args)>(args)...); },
+				std::forward<Args>(args)...);
+		}
+
+		// the arguments are stored by value and passed to fn as rvalues
+		// the task and the state of its future share a single allocation from the memory pool
+		// if the task is still queued when someone waits for its future, it runs on the waiting thread
+		template<class F, class... Args>
+		auto operator()(F fn, Args&&... args) -> Future<decltype(fn(std::declval<std::decay_t<Args>>()...))>
+		{
+			return (*this)(NORMAL, Clock::time_point::max(), std::move(fn), std::forward<Args>(args)...);
+		}
+
+		// HIGH priority tasks are picked before anything else, BACKGROUND tasks only run when
+		// there is nothing more important to do or they have been passed over for too long
+		template<class F, class... Args>
+		auto operator()(TaskPriority priority, F fn, Args&&... args) -> Future<decltype(fn(std::declval<std::decay_t<Args>>()...))>
+		{
+			return (*this)(priority, Clock::time_point::max(), std::move(fn), std::forward<Args>(args)...);
+		}
+
+		// tasks with a deadline run before the other tasks of the same priority, earliest deadline first,
+		// and overdue tasks run before anything else
+		template<class F, class... Args>
+		auto operator()(TaskPriority priority, Clock::time_point deadline, F fn, Args&&... args) -> Future<decltype(fn(std::declval<std::decay_t<Args>>()...))>
+		{
+			typedef decltype(fn(std::declval<std::decay_t<Args>>()...)) R;
+
+			auto state = createTaskState<R>(m_memory, this, std::move(fn), std::forward<Args>(args)...);
+			state->priority = priority;
+			state->deadline = deadline;
+			state->addRef(); // the queue's reference
+			Future<R> result(state);
+			submit(state);
+			return result;
+		}
+
+		// runs fn() on a worker without creating a future, fn must not throw
+		// posted functions are never rejected: if the queue is full (with the REJECT policy) or the TaskManager
+		// is shut down, fn runs on the calling thread, so continuations still run
+		template<class F>
+		void post(F fn, TaskPriority priority = NORMAL)
+		{
+			Task* task = createTask(std::move(fn));
+			task->priority = priority;
+			submit(task, false);
+		}
+
+		// queues a task for every fn() in [first, last) at once and wakes up only as many workers as needed
+		// the returned future is ready when all of them are done, with the first exception if any of them failed
+		template<class Iterator>
+		Future<void> submitBatch(Iterator first, Iterator last, TaskPriority priority = NORMAL)
+		{
+			typedef std::decay_t<decltype(*first)> F;
+
+			const size_t count = static_cast<size_t>(std::distance(first, last));
+			auto batch = Batch<F, NoSharedData>::create(m_memory, this, count, NoSharedData());
+			Future<void> result = batch->getFuture();
+
+			try
+			{
+				for (size_t i = 0; i < count; ++i, ++first)
+					batch->constructTask(i, *first);
+			}
+			catch (...)
+			{
+				batch->discard();
+				throw;
+			}
+
+			batch->submit(priority);
+			return result;
+		}
+
+		// the same as submitBatch() for fn(0), fn(1), ... fn(count - 1), the tasks share a single copy of fn
+		template<class F>
+		Future<void> bulk(size_t count, F fn, TaskPriority priority = NORMAL)
+		{
+			auto batch = Batch<IndexCall<F>, F>::create(m_memory, this, count, std::move(fn));
+			Future<void> result = batch->getFuture();
+
+			for (size_t i = 0; i < count; ++i)
+				batch->constructTask(i, IndexCall<F>{ &batch->getSharedData(), i });
+
+			batch->submit(priority);
+			return result;
+		}
+
+		size_t getWorkerCount() const
+		{
+			return m_workers.size();
+		}
+
+		IMemoryPool* getMemoryPool() const
+		{
+			return m_memory;
+		}
+
+		// waits until every queued task is done, including the ones submitted in the meantime
+		// it can't be called from a worker, since the task calling it would never finish
+		void drain()
+		{
+			if (getWorkerContext().manager == this)
+				throw std::logic_error("TaskManager::drain() called from a worker thread");
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			++m_drain_waiters;
+			m_idle_notifier.wait(lock, [this] { return (m_unfinished_tasks.load() == 0); });
+			--m_drain_waiters;
+		}
+
+		// new tasks are rejected with TaskRejectedError from now on, then either every queued task runs (wait_all)
+		// or the queued tasks are dropped and their futures receive a broken_promise error
+		// the running tasks are always finished before the workers stop
+		void shutdown(bool wait_all = true)
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_shutdown = true;
+				m_space_notifier.notify_all();
+			}
+
+			if (wait_all)
+				drain();
+
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_exit = true;
+				m_notifier.notify_all();
+			}
+
+			for (auto& thread : m_threads)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+
+			// submitters check m_shutdown under m_mutex before touching the shared queues, so nothing is queued from now on
+			size_t dropped = 0;
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+
+				for (auto& queue : m_queues)
+				{
+					while (Task* task = queue.head)
+					{
+						queue.head = task->next;
+						dropTask(task);
+						++dropped;
+					}
+
+					for (auto task : queue.deadlines)
+					{
+						dropTask(task);
+						++dropped;
+					}
+
+					queue.tail = nullptr;
+					queue.deadlines.clear();
+				}
+
+				m_shared_tasks = 0;
+				m_deadline_tasks = 0;
+			}
+
+			for (auto& worker : m_workers)
+			{
+				while (Task* task = worker->tasks.pop())
+				{
+					dropTask(task);
+					++dropped;
+				}
+			}
+
+			// the dropped tasks are finished too
+			if (dropped > 0)
+			{
+				m_queued_tasks.fetch_sub(dropped);
+				releaseCapacity(dropped);
+				finishTasks(dropped);
+			}
+		}
+
+		bool isShutdown() const
+		{
+			return m_shutdown.load();
+		}
+
+		// number of tasks that are queued or running
+		size_t getUnfinishedTasks() const
+		{
+			return m_unfinished_tasks.load();
+		}
+
+		// the counters are only updated if TaskManagerConfig::collect_stats is set
+		WorkerStats getWorkerStats(size_t worker) const
+		{
+			const WorkerCounters& counters = m_workers.at(worker)->counters;
+
+			WorkerStats stats;
+			stats.tasks_executed = counters.tasks_executed.load(std::memory_order_relaxed);
+			stats.busy_time_ns = counters.busy_time_ns.load(std::memory_order_relaxed);
+			stats.idle_time_ns = counters.idle_time_ns.load(std::memory_order_relaxed);
+			stats.steal_attempts = counters.steal_attempts.load(std::memory_order_relaxed);
+			stats.steals = counters.steals.load(std::memory_order_relaxed);
+			stats.queue_depth = m_workers[worker]->tasks.size();
+
+			for (size_t i = 0; i < WorkerStats::BUCKETS; ++i)
+				stats.latency[i] = counters.latency[i].load(std::memory_order_relaxed);
+
+			return stats;
+		}
+
+		void resetStats()
+		{
+			for (auto& worker : m_workers)
+				worker->counters.reset();
+		}
+
+		// number of queued tasks that haven't been picked up by a worker yet
+		size_t getQueueDepth(TaskPriority priority) const
+		{
+			return m_queue_depth[priority].load();
+		}
+
+		static bool isWorkerThread()
+		{
+			return (getWorkerContext().manager != nullptr);
+		}
+
+		// runs a queued task if the calling thread is a worker of any TaskManager
+		// returns false if it isn't or if there was nothing to run
+		static bool runPendingTask()
+		{
+			WorkerContext& context = getWorkerContext();
+			return (context.manager && context.manager->runTask(context.index));
+		}
+
+	private:
+		class Task
+		{
+		public:
+			Task* next = nullptr; // in the shared queue
+			TaskPriority priority = NORMAL;
+			Clock::time_point deadline = Clock::time_point::max();
+			Clock::time_point queued; // only set if the TaskManager is instrumented
+
+			virtual ~Task() = default;
+			virtual void run() = 0;
+
+			// called after run(), or instead of it if the task is dropped
+			virtual void destroy(IMemoryPool* memory) = 0;
+		};
+
+		template<class F>
+		class FunctionTask : public Task
+		{
+		public:
+			FunctionTask(F&& fn) :
+				m_fn(std::move(fn))
+			{
+			}
+
+			virtual void run()
+			{
+				m_fn();
+			}
+
+			virtual void destroy(IMemoryPool* memory)
+			{
+				raz::Allocator<FunctionTask> alloc(memory);
+				this->~FunctionTask();
+				alloc.deallocate(this, 1);
+			}
+
+		private:
+			F m_fn;
+		};
+
+		template<class R, class F, class... Args>
+		class TaskState : public FutureState<R>, public Task
+		{
+		public:
+			template<class... CArgs>
+			TaskState(IMemoryPool* memory, TaskManager* executor, F&& fn, CArgs&&... args) :
+				FutureState<R>(memory, executor),
+				m_started(false),
+				m_fn(std::move(fn)),
+				m_args(std::forward<CArgs>(args)...)
+			{
+			}
+
+			virtual void run()
+			{
+				execute();
+			}
+
+			virtual void destroy(IMemoryPool*)
+			{
+				if (!m_started.exchange(true))
+					this->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+
+				this->release();
+			}
+
+		protected:
+			~TaskState() = default;
+
+			virtual void destroy()
+			{
+				raz::Allocator<TaskState> alloc(this->getMemoryPool());
+				this->~TaskState();
+				alloc.deallocate(this, 1);
+			}
+
+			virtual void runInline()
+			{
+				execute();
+			}
+
+		private:
+			std::atomic<bool> m_started; // either a worker or a waiting thread runs the task
+			F m_fn;
+			std::tuple<Args...> m_args;
+
+			void execute()
+			{
+				if (!m_started.exchange(true))
+					this->setResult([this] { return call(std::index_sequence_for<Args...>()); });
+			}
+
+			template<size_t... I>
+			R call(std::index_sequence<I...>)
+			{
+				return m_fn(std::move(std::get<I>(m_args))...);
+			}
+		};
+
+		// completes the future of a batch when its last task is done (or dropped)
+		class BatchBase
+		{
+		public:
+			BatchBase(IMemoryPool* memory, TaskManager* executor, size_t count) :
+				m_executor(executor),
+				m_promise(memory, executor),
+				m_remaining(count),
+				m_failed(false)
+			{
+			}
+
+			Future<void> getFuture()
+			{
+				return m_promise.getFuture();
+			}
+
+			void setException(std::exception_ptr exception)
+			{
+				if (!m_failed.exchange(true))
+					m_exception = exception;
+			}
+
+			void taskDone()
+			{
+				if (m_remaining.fetch_sub(1) != 1)
+					return;
+
+				Promise<void> promise(std::move(m_promise));
+				std::exception_ptr exception = m_exception;
+				destroy();
+
+				if (exception)
+					promise.setException(exception);
+				else
+					promise.setValue();
+			}
+
+		protected:
+			TaskManager* m_executor;
+
+			virtual ~BatchBase() = default;
+			virtual void destroy() = 0;
+
+		private:
+			Promise<void> m_promise;
+			std::atomic<size_t> m_remaining;
+			std::atomic<bool> m_failed;
+			std::exception_ptr m_exception;
+		};
+
+		template<class F>
+		class BatchTask : public Task
+		{
+		public:
+			BatchTask(BatchBase* batch, F&& fn) :
+				m_batch(batch),
+				m_fn(std::move(fn)),
+				m_started(false)
+			{
+			}
+
+			virtual void run()
+			{
+				m_started = true;
+
+				try
+				{
+					m_fn();
+				}
+				catch (...)
+				{
+					m_batch->setException(std::current_exception());
+				}
+			}
+
+			// the task array belongs to the batch, the last task frees it
+			virtual void destroy(IMemoryPool*)
+			{
+				if (!m_started)
+					m_batch->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+
+				m_batch->taskDone();
+			}
+
+		private:
+			BatchBase* m_batch;
+			F m_fn;
+			bool m_started;
+		};
+
+		struct NoSharedData
+		{
+		};
+
+		template<class F>
+		struct IndexCall
+		{
+			F* fn;
+			size_t index;
+
+			void operator()()
+			{
+				(*fn)(index);
+			}
+		};
+
+		template<class F, class SharedData>
+		class Batch : public BatchBase
+		{
+		public:
+			static Batch* create(IMemoryPool* memory, TaskManager* executor, size_t count, SharedData&& data)
+			{
+				raz::Allocator<Batch> alloc(memory);
+				Batch* batch = alloc.allocate(1);
+
+				try
+				{
+					new (batch) Batch(memory, executor, count, std::move(data));
+				}
+				catch (...)
+				{
+					alloc.deallocate(batch, 1);
+					throw;
+				}
+
+				return batch;
+			}
+
+			SharedData& getSharedData()
+			{
+				return m_data;
+			}
+
+			// frees a batch that couldn't be submitted
+			void discard()
+			{
+				destroy();
+			}
+
+			void constructTask(size_t index, F fn)
+			{
+				new (&m_tasks[index]) BatchTask<F>(this, std::move(fn));
+				++m_constructed;
+			}
+
+			// the batch may be gone by the time this returns
+			void submit(TaskPriority priority)
+			{
+				if (m_count == 0)
+				{
+					// nothing will call taskDone(), so the batch completes here
+					this->taskDone();
+					return;
+				}
+
+				for (size_t i = 0; i < m_count; ++i)
+				{
+					m_tasks[i].priority = priority;
+					m_tasks[i].next = (i + 1 < m_count) ? &m_tasks[i + 1] : nullptr;
+				}
+
+				m_executor->submitAll(&m_tasks[0], m_count, priority);
+			}
+
+		private:
+			IMemoryPool* m_memory;
+			SharedData m_data;
+			BatchTask<F>* m_tasks;
+			size_t m_count;
+			size_t m_constructed;
+
+			Batch(IMemoryPool* memory, TaskManager* executor, size_t count, SharedData&& data) :
+				BatchBase(memory, executor, (count > 0) ? count : 1),
+				m_memory(memory),
+				m_data(std::move(data)),
+				m_tasks(raz::Allocator<BatchTask<F>>(memory).allocate((count > 0) ? count : 1)),
+				m_count(count),
+				m_constructed(0)
+			{
+			}
+
+			~Batch()
+			{
+				for (size_t i = 0; i < m_constructed; ++i)
+					m_tasks[i].~BatchTask<F>();
+
+				raz::Allocator<BatchTask<F>>(m_memory).deallocate(m_tasks, (m_count > 0) ? m_count : 1);
+			}
+
+			virtual void destroy()
+			{
+				raz::Allocator<Batch> alloc(m_memory);
+				this->~Batch();
+				alloc.deallocate(this, 1);
+			}
+		};
+
+		// written by the worker only, relaxed atomics so they can be read any time
+		struct WorkerCounters
+		{
+			std::atomic<uint64_t> tasks_executed;
+			std::atomic<uint64_t> busy_time_ns;
+			std::atomic<uint64_t> idle_time_ns;
+			std::atomic<uint64_t> steal_attempts;
+			std::atomic<uint64_t> steals;
+			std::atomic<uint64_t> latency[WorkerStats::BUCKETS];
+
+			WorkerCounters()
+			{
+				reset();
+			}
+
+			void reset()
+			{
+				tasks_executed = 0;
+				busy_time_ns = 0;
+				idle_time_ns = 0;
+				steal_attempts = 0;
+				steals = 0;
+
+				for (auto& count : latency)
+					count = 0;
+			}
+
+			static void add(std::atomic<uint64_t>& counter, uint64_t value)
+			{
+				counter.fetch_add(value, std::memory_order_relaxed);
+			}
+		};
+
+		struct Worker
+		{
+			WorkStealingDeque<Task> tasks;
+			size_t local_streak = 0; // tasks taken from the local queue in a row
+			WorkerCounters counters;
+			size_t nested_tasks = 0;
+			size_t trace_countdown = 0;
+		};
+
+		typedef std::vector<Task*, raz::Allocator<Task*>> DeadlineHeap;
+
+		struct PriorityQueue
+		{
+			Task* head = nullptr;
+			Task* tail = nullptr;
+			DeadlineHeap deadlines; // min-heap on the deadline
+			size_t passed_over = 0;
+
+			bool empty() const
+			{
+				return (!head && deadlines.empty());
+			}
+		};
+
+		struct WorkerContext
+		{
+			TaskManager* manager;
+			size_t index;
+		};
+
+		IMemoryPool* m_memory;
+		WakeupMode m_wakeup;
+		bool m_collect_stats;
+		std::function<void(const TaskTrace&)> m_trace_hook;
+		size_t m_trace_sample_interval;
+		size_t m_queue_capacity;
+		OverflowPolicy m_overflow_policy;
+		std::atomic<size_t> m_admitted_tasks; // only counted with a queue capacity
+		std::atomic<size_t> m_blocked_producers;
+		std::atomic<size_t> m_unfinished_tasks;
+		std::atomic<size_t> m_drain_waiters;
+		std::atomic<bool> m_shutdown;
+		std::condition_variable m_space_notifier;
+		std::condition_variable m_idle_notifier;
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::vector<NativeThread, raz::Allocator<NativeThread>> m_threads;
+		PriorityQueue m_queues[PRIORITY_LEVELS]; // shared between the workers, guarded by m_mutex
+		size_t m_deadline_tasks;
+		std::atomic<size_t> m_queue_depth[PRIORITY_LEVELS];
+		std::atomic<size_t> m_queued_tasks;
+		std::atomic<size_t> m_shared_tasks;
+		std::atomic<size_t> m_sleeping_workers;
+		std::mutex m_mutex;
+		std::condition_variable m_notifier;
+		std::atomic<bool> m_exit;
+
+		static TaskManagerConfig makeConfig(size_t threads, IMemoryPool* memory, WakeupMode wakeup)
+		{
+			TaskManagerConfig config;
+			config.threads = threads;
+			config.memory = memory;
+			config.wakeup = wakeup;
+			return config;
+		}
+
+		static WorkerContext& getWorkerContext()
+		{
+			static thread_local WorkerContext context = { nullptr, 0 };
+			return context;
+		}
+
+		template<class F>
+		Task* createTask(F&& fn)
+		{
+			typedef FunctionTask<std::decay_t<F>> TaskType;
+
+			raz::Allocator<TaskType> alloc(m_memory);
+			TaskType* task = alloc.allocate(1);
+
+			try
+			{
+				new (task) TaskType(std::forward<F>(fn));
+			}
+			catch (...)
+			{
+				alloc.deallocate(task, 1);
+				throw;
+			}
+
+			return task;
+		}
+
+		template<class R, class F, class... Args>
+		static TaskState<R, F, std::decay_t<Args>...>* createTaskState(IMemoryPool* memory, TaskManager* executor, F&& fn, Args&&... args)
+		{
+			typedef TaskState<R, F, std::decay_t<Args>...> State;
+
+			raz::Allocator<State> alloc(memory);
+			State* state = alloc.allocate(1);
+
+			try
+			{
+				new (state) State(memory, executor, std::move(fn), std::forward<Args>(args)...);
+			}
+			catch (...)
+			{
+				alloc.deallocate(state, 1);
+				throw;
+			}
+
+			return state;
+		}
+
+		void destroyTask(Task* task)
+		{
+			task->destroy(m_memory);
+		}
+
+		static bool laterDeadline(const Task* a, const Task* b)
+		{
+			return (a->deadline > b->deadline);
+		}
+
+		bool isInstrumented() const
+		{
+			return (m_collect_stats || m_trace_hook);
+		}
+
+		// returns false if the tasks should run on the calling thread instead of being queued
+		// posted tasks ('rejectable' = false) run on the caller instead of being rejected
+		bool admit(size_t count, bool rejectable)
+		{
+			if (m_shutdown.load())
+			{
+				if (rejectable)
+					throw TaskRejectedError("TaskManager is shut down");
+
+				return false;
+			}
+
+			if (m_queue_capacity == 0)
+				return true;
+
+			size_t admitted = m_admitted_tasks.load();
+			for (;;)
+			{
+				// a batch larger than the capacity is admitted if the queue is empty
+				if (admitted == 0 || admitted + count <= m_queue_capacity)
+				{
+					if (m_admitted_tasks.compare_exchange_weak(admitted, admitted + count))
+						return true;
+
+					continue;
+				}
+
+				if (m_overflow_policy == RUN_INLINE || (m_overflow_policy == REJECT && !rejectable))
+					return false;
+
+				if (m_overflow_policy == REJECT)
+					throw TaskRejectedError("TaskManager queue is full");
+
+				// BLOCK, but a worker can't wait for itself
+				if (getWorkerContext().manager == this)
+					return false;
+
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					++m_blocked_producers;
+					m_space_notifier.wait(lock, [this, &admitted, count]
+					{
+						admitted = m_admitted_tasks.load();
+						return (m_shutdown.load() || admitted == 0 || admitted + count <= m_queue_capacity);
+					});
+					--m_blocked_producers;
+				}
+
+				if (m_shutdown.load())
+					return admit(count, rejectable);
+			}
+		}
+
+		void runOnCaller(Task* t)
+		{
+			t->run();
+			destroyTask(t);
+		}
+
+		// frees queue capacity for blocked producers
+		void releaseCapacity(size_t count)
+		{
+			if (m_queue_capacity == 0)
+				return;
+
+			m_admitted_tasks.fetch_sub(count);
+			if (m_blocked_producers.load() > 0)
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_space_notifier.notify_all();
+			}
+		}
+
+		void finishTasks(size_t count)
+		{
+			if (m_unfinished_tasks.fetch_sub(count) == count && m_drain_waiters.load() > 0)
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				m_idle_notifier.notify_all();
+			}
+		}
+
+		void dropTask(Task* task)
+		{
+			m_queue_depth[task->priority].fetch_sub(1);
+			destroyTask(task);
+		}
+
+		// undoes the admission of tasks that lost the race with shutdown(), they are rejected or run on the caller
+		void withdraw(Task* first, size_t count, bool rejectable)
+		{
+			releaseCapacity(count);
+			finishTasks(count);
+
+			for (Task* task = first; task; )
+			{
+				Task* next = task->next;
+				if (rejectable)
+					destroyTask(task);
+				else
+					runOnCaller(task);
+				task = next;
+			}
+
+			if (rejectable)
+				throw TaskRejectedError("TaskManager is shut down");
+		}
+
+		void submit(Task* t, bool rejectable = true)
+		{
+			WorkerContext& context = getWorkerContext();
+
+			try
+			{
+				if (!admit(1, rejectable))
+				{
+					runOnCaller(t);
+					return;
+				}
+			}
+			catch (...)
+			{
+				destroyTask(t);
+				throw;
+			}
+
+			m_unfinished_tasks.fetch_add(1);
+
+			if (isInstrumented())
+				t->queued = Clock::now();
+
+			// only plain tasks go to the worker's own queue, the ones with a priority or deadline are shared
+			// a worker's own queue is only flushed after the worker is joined, so it can't miss a shutdown
+			if (context.manager == this && t->priority == NORMAL && t->deadline == Clock::time_point::max())
+			{
+				// the counters are incremented first, so a worker never sleeps while there are queued tasks
+				m_queue_depth[t->priority].fetch_add(1);
+				m_queued_tasks.fetch_add(1);
+				m_workers[context.index]->tasks.push(t);
+
+				if (m_sleeping_workers.load() > 0)
+				{
+					std::lock_guard<std::mutex> guard(m_mutex);
+					m_notifier.notify_one();
+				}
+			}
+			else
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+
+					// shutdown() may have flushed the queues since admit()
+					if (m_shutdown)
+					{
+						lock.unlock();
+						t->next = nullptr;
+						withdraw(t, 1, rejectable);
+						return;
+					}
+
+					m_queue_depth[t->priority].fetch_add(1);
+					m_queued_tasks.fetch_add(1);
+					m_shared_tasks.fetch_add(1);
+
+					PriorityQueue& queue = m_queues[t->priority];
+					if (t->deadline != Clock::time_point::max())
+					{
+						queue.deadlines.push_back(t);
+						std::push_heap(queue.deadlines.begin(), queue.deadlines.end(), &TaskManager::laterDeadline);
+						++m_deadline_tasks;
+					}
+					else
+					{
+						if (queue.tail)
+							queue.tail->next = t;
+						else
+							queue.head = t;
+
+						queue.tail = t;
+					}
+				}
+
+				if (m_sleeping_workers.load() > 0)
+					m_notifier.notify_one();
+			}
+		}
+
+		// 'first' is a linked list of 'count' tasks with the same priority and no deadline
+		void submitAll(Task* first, size_t count, TaskPriority priority)
+		{
+			WorkerContext& context = getWorkerContext();
+
+			bool admitted;
+			try
+			{
+				admitted = admit(count, true);
+			}
+			catch (...)
+			{
+				for (Task* task = first; task; )
+				{
+					Task* next = task->next;
+					destroyTask(task);
+					task = next;
+				}
+
+				throw;
+			}
+
+			if (!admitted)
+			{
+				for (Task* task = first; task; )
+				{
+					Task* next = task->next;
+					runOnCaller(task);
+					task = next;
+				}
+
+				return;
+			}
+
+			m_unfinished_tasks.fetch_add(count);
+
+			if (isInstrumented())
+			{
+				const auto now = Clock::now();
+				for (Task* task = first; task; task = task->next)
+					task->queued = now;
+			}
+
+			if (context.manager == this && priority == NORMAL)
+			{
+				m_queue_depth[priority].fetch_add(count);
+				m_queued_tasks.fetch_add(count);
+
+				auto& tasks = m_workers[context.index]->tasks;
+				for (Task* task = first; task; )
+				{
+					Task* next = task->next;
+					task->next = nullptr;
+					tasks.push(task);
+					task = next;
+				}
+			}
+			else
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+
+				if (m_shutdown)
+				{
+					lock.unlock();
+					withdraw(first, count, true);
+					return;
+				}
+
+				m_queue_depth[priority].fetch_add(count);
+				m_queued_tasks.fetch_add(count);
+				m_shared_tasks.fetch_add(count);
+
+				Task* last = first;
+				while (last->next)
+					last = last->next;
+
+				PriorityQueue& queue = m_queues[priority];
+				if (queue.tail)
+					queue.tail->next = first;
+				else
+					queue.head = first;
+
+				queue.tail = last;
+			}
+
+			// no more workers are woken up than there are tasks
+			const size_t sleeping = m_sleeping_workers.load();
+			if (sleeping > 0)
+			{
+				std::lock_guard<std::mutex> guard(m_mutex);
+				if (count >= sleeping)
+				{
+					m_notifier.notify_all();
+				}
+				else
+				{
+					for (size_t i = 0; i < count; ++i)
+						m_notifier.notify_one();
+				}
+			}
+		}
+
+		Task* popSharedTask()
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+
+			size_t level = PRIORITY_LEVELS;
+			bool by_deadline = false;
+
+			// overdue tasks first
+			if (m_deadline_tasks > 0)
+			{
+				const auto now = Clock::now();
+				for (size_t i = 0; i < PRIORITY_LEVELS; ++i)
+				{
+					auto& deadlines = m_queues[i].deadlines;
+					if (!deadlines.empty() && deadlines.front()->deadline <= now &&
+						(!by_deadline || laterDeadline(m_queues[level].deadlines.front(), deadlines.front())))
+					{
+						level = i;
+						by_deadline = true;
+					}
+				}
+			}
+
+			// then the lowest level that has been starving, otherwise the highest non-empty level
+			if (level == PRIORITY_LEVELS)
+			{
+				for (size_t i = PRIORITY_LEVELS - 1; i > 0; --i)
+				{
+					if (!m_queues[i].empty() && m_queues[i].passed_over >= STARVATION_LIMIT)
+					{
+						level = i;
+						break;
+					}
+				}
+			}
+
+			if (level == PRIORITY_LEVELS)
+			{
+				for (size_t i = 0; i < PRIORITY_LEVELS; ++i)
+				{
+					if (!m_queues[i].empty())
+					{
+						level = i;
+						break;
+					}
+				}
+
+				if (level == PRIORITY_LEVELS)
+					return nullptr;
+			}
+
+			for (size_t i = 0; i < PRIORITY_LEVELS; ++i)
+			{
+				if (i != level && !m_queues[i].empty())
+					++m_queues[i].passed_over;
+			}
+
+			PriorityQueue& queue = m_queues[level];
+			queue.passed_over = 0;
+
+			Task* task;
+			if (!queue.deadlines.empty())
+			{
+				std::pop_heap(queue.deadlines.begin(), queue.deadlines.end(), &TaskManager::laterDeadline);
+				task = queue.deadlines.back();
+				queue.deadlines.pop_back();
+				--m_deadline_tasks;
+			}
+			else
+			{
+				task = queue.head;
+				queue.head = task->next;
+				if (!queue.head)
+					queue.tail = nullptr;
+
+				task->next = nullptr;
+			}
+
+			m_shared_tasks.fetch_sub(1);
+			return task;
+		}
+
+		Task* findTask(size_t index)
+		{
+			Worker& worker = *m_workers[index];
+			Task* task;
 
-			m_exit_token.set_value();
+			// HIGH priority tasks don't wait for the local queue, neither do the other shared tasks
+			// if the local queue has been preferred for too long
+			if (m_shared_tasks.load() > 0 &&
+				(m_queue_depth[HIGH].load() > 0 || worker.local_streak >= STARVATION_LIMIT))
+			{
+				worker.local_streak = 0;
+				task = popSharedTask();
+				if (task)
+					return task;
+			}
 
-			for (auto& thread : m_threads)
-				thread.join();
+			task = worker.tasks.pop();
+			if (task)
+			{
+				++worker.local_streak;
+				return task;
+			}
+
+			worker.local_streak = 0;
+			task = popSharedTask();
+			if (task)
+				return task;
+
+			for (size_t i = 1; i < m_workers.size(); ++i)
+			{
+				task = m_workers[(index + i) % m_workers.size()]->tasks.steal();
+
+				if (m_collect_stats)
+				{
+					WorkerCounters::add(worker.counters.steal_attempts, 1);
+					if (task)
+						WorkerCounters::add(worker.counters.steals, 1);
+				}
+
+				if (task)
+					return task;
+			}
+
+			return nullptr;
 		}
 
-		TaskManager(const TaskManager&) = delete;
+		bool runTask(size_t index)
+		{
+			Task* task = findTask(index);
+			if (!task)
+				return false;
 
-		TaskManager& operator=(const TaskManager&) = delete;
+			m_queued_tasks.fetch_sub(1);
+			m_queue_depth[task->priority].fetch_sub(1);
+			releaseCapacity(1);
 
-		template<class R, class C, class... fnArgs, class... Args>
-		static std::shared_future<R> pack(std::shared_ptr<C> obj, R(C::*fn)(fnArgs...), Args&&... args)
+			if (isInstrumented())
+				runInstrumented(index, task);
+			else
+				task->run();
+
+			destroyTask(task);
+			finishTasks(1);
+			return true;
+		}
+
+		void runInstrumented(size_t index, Task* task)
 		{
-			auto converted_fn = [](std::shared_ptr<C> obj, R(C::*fn)(fnArgs...), Args&&... args)->R
+			Worker& worker = *m_workers[index];
+
+			TaskTrace trace;
+			trace.worker = index;
+			trace.priority = task->priority;
+			trace.queued = task->queued;
+			trace.started = Clock::now();
+
+			++worker.nested_tasks;
+			task->run();
+			--worker.nested_tasks;
+
+			trace.finished = Clock::now();
+
+			if (m_collect_stats)
 			{
-				return obj->*fn(std::forward<Args>(args)...);
-			};
+				WorkerCounters& counters = worker.counters;
+				WorkerCounters::add(counters.tasks_executed, 1);
+
+				if (worker.nested_tasks == 0)
+					WorkerCounters::add(counters.busy_time_ns, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(trace.finished - trace.started).count()));
+
+				const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(trace.started - trace.queued).count();
+				size_t bucket = 0;
+				while (bucket < WorkerStats::BUCKETS - 1 && latency >= (1ll << bucket))
+					++bucket;
+
+				WorkerCounters::add(counters.latency[bucket], 1);
+			}
+
+			if (m_trace_hook)
+			{
+				if (worker.trace_countdown == 0)
+				{
+					worker.trace_countdown = m_trace_sample_interval;
+					m_trace_hook(trace);
+				}
 
-			return std::async(std::launch::deferred, converted_fn, obj, fn, std::forward<Args>(args)...);
+				--worker.trace_countdown;
+			}
 		}
 
-		template<class C, class... Args>
-		static auto pack(std::shared_ptr<C> obj, Args&&... args) -> std::shared_future<decltype(obj->operator()(args...))>
+		struct IdleTimer
 		{
-			auto converted_fn = [](std::shared_ptr<C> obj, Args&&... args)
+			WorkerCounters* counters;
+			Clock::time_point start;
+
+			IdleTimer(WorkerCounters* counters) :
+				counters(counters)
 			{
-				return obj->operator()(std::forward<Args>(args)...);
-			};
+				if (counters)
+					start = Clock::now();
+			}
+
+			~IdleTimer()
+			{
+				if (counters)
+					WorkerCounters::add(counters->idle_time_ns, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+			}
+		};
+
+		void run(size_t index)
+		{
+			WorkerContext& context = getWorkerContext();
+			context.manager = this;
+			context.index = index;
+
+			// tasks that are still queued when the TaskManager is destroyed are dropped
+			while (!m_exit)
+			{
+				if (runTask(index))
+					continue;
 
-			return std::async(std::launch::deferred, converted_fn, obj, std::forward<Args>(args)...);
+				IdleTimer idle_timer(m_collect_stats ? &m_workers[index]->counters : nullptr);
+
+				if (m_wakeup == SPIN_THEN_PARK)
+				{
+					const auto spin_until = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+					while (!m_exit && m_queued_tasks.load() == 0 && std::chrono::steady_clock::now() < spin_until)
+						std::this_thread::yield();
+
+					if (m_queued_tasks.load() > 0)
+						continue;
+				}
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				++m_sleeping_workers;
+				m_notifier.wait(lock, [this] { return (m_exit || m_queued_tasks.load() > 0); });
+				--m_sleeping_workers;
+			}
 		}
+	};
 
-		template<class F, class... Args>
-		static auto pack(F fn, Args&&... args) -> std::shared_future<decltype(fn(args...))>
+	inline void FutureStateBase::wait()
+	{
+		if (isReady())
+			return;
+
+		runInline();
+		if (isReady())
+			return;
+
+		if (TaskManager::isWorkerThread())
+		{
+			// a blocked worker could deadlock if the awaited task is queued behind it, so it helps out instead
+			while (!isReady())
+			{
+				if (TaskManager::runPendingTask())
+					continue;
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_notifier.wait_for(lock, std::chrono::microseconds(100), [this] { return isReady(); });
+			}
+		}
+		else
 		{
-			return std::async(std::launch::deferred, fn, std::forward<Args>(args)...);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notifier.wait(lock, [this] { return isReady(); });
 		}
+	}
 
-		template<class R, class C, class... fnArgs, class... Args>
-		std::shared_future<R> operator()(std::shared_ptr<C> obj, R(C::*fn)(fnArgs...), Args&&... args)
+	template<class R>
+	template<class F>
+	auto Future<R>::then(F fn) const -> Future<ThenResult<F>>
+	{
+		typedef ThenResult<F> Result;
+
+		class ThenCall
 		{
-			auto result = pack(obj, fn, std::forward<Args>(args)...);
+		public:
+			ThenCall(F&& fn, Promise<Result>&& promise, TaskManager* executor) :
+				m_fn(std::move(fn)), m_promise(std::move(promise)), m_executor(executor)
+			{
+			}
 
-			std::lock_guard<std::mutex> guard(m_mutex);
-			m_tasklist.push_back([result] { result.wait(); });
-			m_notifier.notify_one();
-			return result;
+			void operator()(const Future<R>& antecedent)
+			{
+				if (m_executor)
+				{
+					TaskManager* executor = m_executor;
+					m_executor = nullptr;
+					executor->post([call = std::move(*this), antecedent]() mutable { call(antecedent); });
+				}
+				else
+				{
+					m_promise.setResult([&] { return FutureValueCall<R>::call(m_fn, antecedent); });
+				}
+			}
+
+		private:
+			F m_fn;
+			Promise<Result> m_promise;
+			TaskManager* m_executor;
+		};
+
+		Promise<Result> promise(getMemoryPool(), getExecutor());
+		Future<Result> result = promise.getFuture();
+		onReady(ThenCall(std::move(fn), std::move(promise), getExecutor()));
+		return result;
+	}
+
+	// the returned future is ready when all of the futures are, it receives the first exception if any of them failed
+	template<class Iterator, class = typename std::iterator_traits<Iterator>::iterator_category>
+	Future<void> when_all(Iterator first, Iterator last, IMemoryPool* memory = nullptr)
+	{
+		struct Shared
+		{
+			Shared(size_t count, IMemoryPool* memory) :
+				remaining(count), failed(false), promise(memory)
+			{
+			}
+
+			std::atomic<size_t> remaining;
+			std::atomic<bool> failed;
+			std::exception_ptr exception;
+			Promise<void> promise;
+		};
+
+		auto shared = raz::allocate_shared<Shared>(memory, static_cast<size_t>(std::distance(first, last)) + 1, memory);
+		Future<void> result = shared->promise.getFuture();
+
+		auto finish = [](Shared& shared)
+		{
+			if (shared.remaining.fetch_sub(1) == 1)
+			{
+				if (shared.failed)
+					shared.promise.setException(shared.exception);
+				else
+					shared.promise.setValue();
+			}
+		};
+
+		for (; first != last; ++first)
+		{
+			first->onReady([shared, finish](const auto& future)
+			{
+				try
+				{
+					future.get();
+				}
+				catch (...)
+				{
+					if (!shared->failed.exchange(true))
+						shared->exception = std::current_exception();
+				}
+
+				finish(*shared);
+			});
 		}
 
-		template<class C, class... Args>
-		auto operator()(std::shared_ptr<C> obj, Args&&... args) -> std::shared_future<decltype(obj->operator()(args...))>
+		// the extra count keeps the result from becoming ready while the callbacks are being added
+		finish(*shared);
+		return result;
+	}
+
+	template<class... R>
+	Future<void> when_all(const Future<R>&... futures)
+	{
+		Future<void> all[] = { Future<void>(), futures.then([](auto&&...) {})... };
+		return when_all(all + 1, all + sizeof...(R) + 1);
+	}
+
+	// the returned future holds the index of the first future that became ready
+	template<class Iterator, class = typename std::iterator_traits<Iterator>::iterator_category>
+	Future<size_t> when_any(Iterator first, Iterator last, IMemoryPool* memory = nullptr)
+	{
+		struct Shared
 		{
-			auto result = pack(obj, std::forward<Args>(args)...);
+			Shared(IMemoryPool* memory) :
+				done(false), promise(memory)
+			{
+			}
 
-			std::lock_guard<std::mutex> guard(m_mutex);
-			m_tasklist.push_back([result] { result.wait(); });
-			m_notifier.notify_one();
-			return result;
+			std::atomic<bool> done;
+			Promise<size_t> promise;
+		};
+
+		auto shared = raz::allocate_shared<Shared>(memory, memory);
+		Future<size_t> result = shared->promise.getFuture();
+
+		for (size_t index = 0; first != last; ++first, ++index)
+		{
+			first->onReady([shared, index](const auto&)
+			{
+				if (!shared->done.exchange(true))
+					shared->promise.setValue(index);
+			});
 		}
 
-		template<class F, class... Args>
-		auto operator()(F fn, Args&&... args) -> std::shared_future<decltype(fn(args...))>
+		return result;
+	}
+
+	// nodes are submitted to the TaskManager as soon as all of their dependencies have finished
+	class TaskGraph
+	{
+	public:
+		typedef size_t Node;
+
+		TaskGraph(TaskManager& taskmgr) :
+			m_taskmgr(taskmgr),
+			m_remaining(0),
+			m_failed(false)
 		{
-			auto result = pack(fn, std::forward<Args>(args)...);
+		}
+
+		TaskGraph(const TaskGraph&) = delete;
+
+		TaskGraph& operator=(const TaskGraph&) = delete;
+
+		template<class F>
+		Node add(F fn)
+		{
+			m_nodes.push_back(NodeData{ std::move(fn), {}, 0 });
+			return (m_nodes.size() - 1);
+		}
+
+		// 'node' doesn't start until 'dependency' has finished
+		void addDependency(Node node, Node dependency)
+		{
+			if (node >= m_nodes.size() || dependency >= m_nodes.size())
+				throw std::out_of_range("TaskGraph node index out of range");
+
+			m_nodes[dependency].successors.push_back(node);
+			++m_nodes[node].dependencies;
+		}
+
+		size_t size() const
+		{
+			return m_nodes.size();
+		}
+
+		// the graph must outlive the returned future and it must not be modified until then
+		// if a node throws, the nodes that haven't started yet are skipped and the future receives the exception
+		Future<void> run()
+		{
+			checkCycles();
+
+			m_pending.reset(new std::atomic<size_t>[m_nodes.size()]);
+			for (size_t i = 0; i < m_nodes.size(); ++i)
+				m_pending[i].store(m_nodes[i].dependencies, std::memory_order_relaxed);
+
+			m_remaining = m_nodes.size();
+			m_failed = false;
+			m_exception = nullptr;
+			m_promise = Promise<void>();
+			Future<void> result = m_promise.getFuture();
+
+			if (m_nodes.empty())
+			{
+				m_promise.setValue();
+				return result;
+			}
+
+			for (Node node = 0; node < m_nodes.size(); ++node)
+			{
+				if (m_nodes[node].dependencies == 0)
+					m_taskmgr.post([this, node] { runNode(node); });
+			}
 
-			std::lock_guard<std::mutex> guard(m_mutex);
-			m_tasklist.push_back([result] { result.wait(); });
-			m_notifier.notify_one();
 			return result;
 		}
 
 	private:
-		typedef std::function<void()> Task;
+		struct NodeData
+		{
+			std::function<void()> fn;
+			std::vector<Node> successors;
+			size_t dependencies;
+		};
 
-		std::vector<std::thread, raz::Allocator<std::thread>> m_threads;
-		std::list<Task, raz::Allocator<Task>> m_tasklist;
-		std::mutex m_mutex;
-		std::condition_variable m_notifier;
-		std::promise<void> m_exit_token;
+		TaskManager& m_taskmgr;
+		std::vector<NodeData> m_nodes;
+		std::unique_ptr<std::atomic<size_t>[]> m_pending;
+		std::atomic<size_t> m_remaining;
+		std::atomic<bool> m_failed;
+		std::exception_ptr m_exception;
+		Promise<void> m_promise;
 
-		void run(std::shared_future<void> exit_token)
+		void runNode(Node node)
 		{
-			while (true)
+			if (!m_failed)
 			{
+				try
 				{
-					std::unique_lock<std::mutex> lock(m_mutex);
-					m_notifier.wait(lock);
+					m_nodes[node].fn();
+				}
+				catch (...)
+				{
+					if (!m_failed.exchange(true))
+						m_exception = std::current_exception();
+				}
+			}
 
-					if (!m_tasklist.empty())
-					{
-						auto task = std::move(m_tasklist.front());
-						m_tasklist.pop_front();
+			for (Node successor : m_nodes[node].successors)
+			{
+				if (m_pending[successor].fetch_sub(1) == 1)
+					m_taskmgr.post([this, successor] { runNode(successor); });
+			}
 
-						lock.unlock();
-						task();
-					}
-				}
+			if (m_remaining.fetch_sub(1) == 1)
+			{
+				// the graph might be destroyed as soon as the future is ready
+				Promise<void> promise(std::move(m_promise));
+				if (m_failed)
+					promise.setException(m_exception);
+				else
+					promise.setValue();
+			}
+		}
+
+		void checkCycles() const
+		{
+			std::vector<size_t> dependencies(m_nodes.size());
+			std::vector<Node> ready;
+
+			for (Node node = 0; node < m_nodes.size(); ++node)
+			{
+				dependencies[node] = m_nodes[node].dependencies;
+				if (dependencies[node] == 0)
+					ready.push_back(node);
+			}
 
-				auto exit_status = exit_token.wait_for(std::chrono::milliseconds(1));
-				if (exit_status == std::future_status::ready)
+			size_t visited = 0;
+			while (!ready.empty())
+			{
+				Node node = ready.back();
+				ready.pop_back();
+				++visited;
+
+				for (Node successor : m_nodes[node].successors)
 				{
-					return;
+					if (--dependencies[successor] == 0)
+						ready.push_back(successor);
 				}
 			}
+
+			if (visited != m_nodes.size())
+				throw std::logic_error("TaskGraph contains a cycle");
+		}
+	};
+
+	// collects TaskTrace samples (use it as TaskManagerConfig::trace_hook) and writes them
+	// in the Chrome trace-event format, which can be opened in chrome://tracing or Perfetto
+	class ChromeTrace
+	{
+	public:
+		// samples over 'max_events' are dropped
+		ChromeTrace(size_t max_events = 1000000) :
+			m_start(std::chrono::steady_clock::now()),
+			m_max_events(max_events),
+			m_dropped_events(0)
+		{
+		}
+
+		ChromeTrace(const ChromeTrace&) = delete;
+
+		ChromeTrace& operator=(const ChromeTrace&) = delete;
+
+		void operator()(const TaskTrace& trace)
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+
+			if (m_events.size() < m_max_events)
+				m_events.push_back(trace);
+			else
+				++m_dropped_events;
+		}
+
+		size_t size() const
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_events.size();
+		}
+
+		size_t getDroppedEvents() const
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			return m_dropped_events;
+		}
+
+		void clear()
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_events.clear();
+			m_dropped_events = 0;
+		}
+
+		// one complete ("X") event per task on the thread of its worker, the queueing time is in its arguments
+		void write(std::ostream& out) const
+		{
+			static const char* const priorities[] = { "high", "normal", "background" };
+
+			std::lock_guard<std::mutex> guard(m_mutex);
+
+			std::vector<size_t> workers;
+			for (const auto& event : m_events)
+			{
+				if (std::find(workers.begin(), workers.end(), event.worker) == workers.end())
+					workers.push_back(event.worker);
+			}
+
+			out << "{\"traceEvents\":[";
+
+			bool first = true;
+			for (size_t worker : workers)
+			{
+				out << (first ? "\n" : ",\n")
+					<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << worker
+					<< ",\"args\":{\"name\":\"worker " << worker << "\"}}";
+				first = false;
+			}
+
+			for (const auto& event : m_events)
+			{
+				out << (first ? "\n" : ",\n")
+					<< "{\"name\":\"task\",\"cat\":\"" << priorities[event.priority]
+					<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.worker
+					<< ",\"ts\":" << toMicroseconds(event.started - m_start)
+					<< ",\"dur\":" << toMicroseconds(event.finished - event.started)
+					<< ",\"args\":{\"queued_us\":" << toMicroseconds(event.started - event.queued) << "}}";
+				first = false;
+			}
+
+			out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+		}
+
+		bool save(const std::string& path) const
+		{
+			std::ofstream file(path, std::ios::out | std::ios::trunc);
+			if (!file)
+				return false;
+
+			write(file);
+			return static_cast<bool>(file);
+		}
+
+	private:
+		std::chrono::steady_clock::time_point m_start;
+		size_t m_max_events;
+		size_t m_dropped_events;
+		std::vector<TaskTrace> m_events;
+		mutable std::mutex m_mutex;
+
+		static double toMicroseconds(std::chrono::steady_clock::duration duration)
+		{
+			return std::chrono::duration<double, std::micro>(duration).count();
 		}
 	};
 }